@@ -0,0 +1,152 @@
+// Echo server benchmark over 127.0.0.1
+//
+// The server and the clients run in two processes, so the fds of the server
+// and the ones of the clients don't count against the same limit. Each client
+// coroutine keeps one connection, sends a message, waits for the echo and
+// measures the time, until the test time is over. The time includes
+// connecting, so large runs need more seconds.
+//
+//   echo_bench [connections=1000] [seconds=5] [threads=1] [msg_size=64]
+//
+// Linux only, it needs fork. 'make bench' builds and runs it.
+//
+// Each connection needs one fd in each process and one coroutine stack, which
+// are two mappings. With many connections, raise 'ulimit -n' and vm.max_map_count.
+// It has been run up to 19.9k connections, on a box limited to 20k fds per
+// process. 50k connections have NOT been measured, it needs a box allowing
+// more than 50k fds per process.
+
+#include "coroutines.h"
+#include "net.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace Coroutines;
+
+static int  nconnections = 1000;
+static int  nseconds = 5;
+static int  nthreads = 1;
+static int  msg_size = 64;
+
+// ----------------------------------------------------------
+// Latencies in microseconds. The last bucket gets anything slower
+static const int max_latency_us = 1000000;
+static std::atomic<uint32_t> latencies[max_latency_us + 1];
+static std::atomic<uint64_t> nrequests(0);
+static std::atomic<int>      nconnected(0);
+static std::atomic<int>      nfailed(0);
+
+static uint32_t percentile(double p) {
+  uint64_t total = 0;
+  for (int i = 0; i <= max_latency_us; ++i)
+    total += latencies[i];
+  uint64_t target = (uint64_t)(total * p);
+  uint64_t acc = 0;
+  for (int i = 0; i <= max_latency_us; ++i) {
+    acc += latencies[i];
+    if (acc > target)
+      return i;
+  }
+  return max_latency_us;
+}
+
+static void raiseFdLimit() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+// ----------------------------------------------------------
+static TListener listener;
+
+static void serveClient(TSocket* s) {
+  std::vector<char> buf(msg_size);
+  while (s->readExactly(buf.data(), buf.size()) && s->writeAll(buf.data(), buf.size())) {
+  }
+  delete s;
+}
+
+static void acceptClients() {
+  // The client closes all its connections when done
+  int nserved = 0;
+  while (nserved < nconnections) {
+    auto s = new TSocket;
+    if (!listener.accept(*s)) {
+      delete s;
+      break;
+    }
+    start([s]() { serveClient(s); });
+    ++nserved;
+  }
+}
+
+// ----------------------------------------------------------
+static void runClient(int port, TTimeStamp deadline) {
+  TSocket s;
+  if (!s.connect("127.0.0.1", port)) {
+    ++nfailed;
+    return;
+  }
+  ++nconnected;
+  std::vector<char> msg(msg_size, 'x');
+  std::vector<char> echo(msg_size);
+  while (now() < deadline) {
+    TTimeStamp t0 = now();
+    if (!s.writeAll(msg.data(), msg.size()) || !s.readExactly(echo.data(), echo.size())) {
+      ++nfailed;
+      return;
+    }
+    uint64_t us = (now() - t0) / 1000;
+    latencies[us < max_latency_us ? us : max_latency_us]++;
+    ++nrequests;
+  }
+}
+
+// ----------------------------------------------------------
+int main(int argc, char** argv) {
+  if (argc > 1) nconnections = atoi(argv[1]);
+  if (argc > 2) nseconds = atoi(argv[2]);
+  if (argc > 3) nthreads = atoi(argv[3]);
+  if (argc > 4) msg_size = atoi(argv[4]);
+  raiseFdLimit();
+
+  // Bind before forking, so the client knows the port
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  if (!listener.listen("127.0.0.1", 0, 65535)) {
+    printf("Can't listen\n");
+    return 1;
+  }
+  int port = listener.port();
+
+  pid_t server = fork();
+  if (server == 0) {
+    start(&acceptClients);
+    runWorkers(nthreads);
+    return 0;
+  }
+  listener.close();
+
+  TTimeStamp deadline = now() + seconds(nseconds);
+  for (int i = 0; i < nconnections; ++i)
+    start([port, deadline]() { runClient(port, deadline); });
+  runWorkers(nthreads);
+
+  kill(server, SIGTERM);
+  waitpid(server, nullptr, 0);
+
+  printf("connections %d/%d threads %d msg %d bytes: %.0f req/s  p50 %u us  p99 %u us  failed %d\n"
+    , nconnected.load(), nconnections, nthreads, msg_size
+    , (double)nrequests / nseconds
+    , percentile(0.50), percentile(0.99)
+    , nfailed.load());
+  return 0;
+}
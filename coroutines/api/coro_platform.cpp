@@ -1,12 +1,70 @@
 #include "coro_platform.h"
+#include <atomic>
 #include <cassert>
 
+// The context we are running now. Switches must be done from it.
+static thread_local TCoroPlatform* running = nullptr;
+
+// Once set, the backend can't change, as the contexts are freed with it
+static std::atomic<bool> contexts_created(false);
+
+#ifdef CORO_PLATFORM_FIBERS
+
 #include <Windows.h>
 
+bool TCoroPlatform::setBackend(eBackend new_backend) {
+  return new_backend == BACKEND_DEFAULT || new_backend == BACKEND_NATIVE;
+}
+
+TCoroPlatform::eBackend TCoroPlatform::currentBackend() {
+  return BACKEND_NATIVE;
+}
+
+// Fibers manage their own stacks
+void TCoroPlatform::setStackPoolLimits(unsigned new_max_cached_stacks, unsigned new_resident_bytes) {
+}
+
+void TCoroPlatform::setStackMeasurement(bool enabled) {
+}
+
+// The fiber keeps its stack, so it's created again with the new size
+void TCoroPlatform::setStackSize(unsigned new_stack_size) {
+  assert(!is_main);
+  if (new_stack_size < min_stack_size)
+    new_stack_size = min_stack_size;
+  if (fiber && new_stack_size != stack_size) {
+    ::DeleteFiber(fiber);
+    fiber = nullptr;
+  }
+  stack_size = new_stack_size;
+}
+
+// The committed part of the stack, which grows a page at a time, and is kept
+// by the fiber. So it's the deepest of all the coroutines run in this one
+unsigned TCoroPlatform::stackUsed() const {
+  assert(running == this);
+  auto tib = (NT_TIB*)::NtCurrentTeb();
+  return (unsigned)((char*)tib->StackBase - (char*)tib->StackLimit);
+}
+
+static VOID WINAPI fiberEntry(LPVOID self) {
+  TCoroPlatform::entryPoint(self);
+}
+
+void TCoroPlatform::entryPoint(void* arg) {
+  auto self = static_cast<TCoroPlatform*>(arg);
+  // The fiber is reused. Once start_fn has exited to another fiber, 
+  // the next start() resumes it, start_fn returns and we run the new one
+  while (true)
+    self->start_fn(self->start_arg);
+}
+
 TCoroPlatform::TCoroPlatform()
   : fiber(nullptr)
   , is_main(false)
   , stack_size( 128 * 1024 )
+  , start_fn(nullptr)
+  , start_arg(nullptr)
 {}
 
 TCoroPlatform::~TCoroPlatform() {
@@ -21,504 +79,506 @@ TCoroPlatform::~TCoroPlatform() {
 void TCoroPlatform::switchTo(TCoroPlatform* other) {
   assert(other);
   assert(other->fiber);
+  running = other;
   ::SwitchToFiber(other->fiber);
 }
 
+void TCoroPlatform::exitTo(TCoroPlatform* other) {
+  switchTo(other);
+}
+
 bool TCoroPlatform::initAsMain() {
   assert(!is_main);
   is_main = true;
   ::ConvertThreadToFiber(nullptr);
   fiber = ::GetCurrentFiber();
+  running = this;
+  contexts_created = true;
   return (fiber != nullptr);
 }
 
-void TCoroPlatform::start(TStartFn fn, void* start_arg) {
-
-  if (fiber && !is_main)
-    ::DeleteFiber(fiber);
+bool TCoroPlatform::allocStack() {
+  assert(!is_main);
+  if (!fiber)
+    fiber = ::CreateFiber(stack_size, &fiberEntry, this);
+  return fiber != nullptr;
+}
 
-  fiber = ::CreateFiber(stack_size, (LPFIBER_START_ROUTINE)fn, start_arg);
-  assert(fiber);
-  switchTo(this);
+void TCoroPlatform::start(TStartFn fn, void* new_start_arg) {
+  assert(!is_main);
+  start_fn = fn;
+  start_arg = new_start_arg;
+
+  bool allocated = allocStack();
+  assert(allocated);
+  (void)allocated;
+  contexts_created = true;
+  assert(running);
+  running->switchTo(this);
 }
 
+#else
 
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef CORO_PLATFORM_NATIVE
+// Saves the callee-saved registers of the running context in its own stack,
+// stores the resulting sp in *from_sp, and resumes the context saved at to_sp.
+// The fp control words (mxcsr/fpcr) are not saved, all contexts share them.
+extern "C" void coro_platform_switch(void** from_sp, void* to_sp);
+// First code executed by a new context. Calls fn(arg), which must not return.
+extern "C" void coro_platform_entry();
+
+#if defined(__x86_64__)
+
+// Frame saved in the stack: r15 r14 r13 r12 rbx rbp <return address>
+asm(
+  ".text\n"
+  ".globl coro_platform_switch\n"
+  ".hidden coro_platform_switch\n"
+  ".type coro_platform_switch,@function\n"
+  ".p2align 4\n"
+  "coro_platform_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  movq  %rsp, (%rdi)\n"
+  "  movq  %rsi, %rsp\n"
+  "  popq  %r15\n"
+  "  popq  %r14\n"
+  "  popq  %r13\n"
+  "  popq  %r12\n"
+  "  popq  %rbx\n"
+  "  popq  %rbp\n"
+  "  ret\n"
+  ".size coro_platform_switch,.-coro_platform_switch\n"
+
+  ".globl coro_platform_entry\n"
+  ".hidden coro_platform_entry\n"
+  ".type coro_platform_entry,@function\n"
+  ".p2align 4\n"
+  "coro_platform_entry:\n"
+  "  movq  %r13, %rdi\n"
+  "  callq *%r12\n"
+  "  ud2\n"
+  ".size coro_platform_entry,.-coro_platform_entry\n"
+);
+
+static const int frame_words = 6;
+static const int reg_fn = 3;       // r12
+static const int reg_arg = 2;      // r13
+
+#elif defined(__aarch64__)
+
+// Frame saved in the stack: x19..x28 x29(fp) x30(lr) d8..d15
+asm(
+  ".text\n"
+  ".globl coro_platform_switch\n"
+  ".hidden coro_platform_switch\n"
+  ".type coro_platform_switch,%function\n"
+  ".p2align 4\n"
+  "coro_platform_switch:\n"
+  "  sub  sp, sp, #160\n"
+  "  stp  x19, x20, [sp, #0]\n"
+  "  stp  x21, x22, [sp, #16]\n"
+  "  stp  x23, x24, [sp, #32]\n"
+  "  stp  x25, x26, [sp, #48]\n"
+  "  stp  x27, x28, [sp, #64]\n"
+  "  stp  x29, x30, [sp, #80]\n"
+  "  stp  d8,  d9,  [sp, #96]\n"
+  "  stp  d10, d11, [sp, #112]\n"
+  "  stp  d12, d13, [sp, #128]\n"
+  "  stp  d14, d15, [sp, #144]\n"
+  "  mov  x2, sp\n"
+  "  str  x2, [x0]\n"
+  "  mov  sp, x1\n"
+  "  ldp  x19, x20, [sp, #0]\n"
+  "  ldp  x21, x22, [sp, #16]\n"
+  "  ldp  x23, x24, [sp, #32]\n"
+  "  ldp  x25, x26, [sp, #48]\n"
+  "  ldp  x27, x28, [sp, #64]\n"
+  "  ldp  x29, x30, [sp, #80]\n"
+  "  ldp  d8,  d9,  [sp, #96]\n"
+  "  ldp  d10, d11, [sp, #112]\n"
+  "  ldp  d12, d13, [sp, #128]\n"
+  "  ldp  d14, d15, [sp, #144]\n"
+  "  add  sp, sp, #160\n"
+  "  ret\n"
+  ".size coro_platform_switch,.-coro_platform_switch\n"
+
+  ".globl coro_platform_entry\n"
+  ".hidden coro_platform_entry\n"
+  ".type coro_platform_entry,%function\n"
+  ".p2align 4\n"
+  "coro_platform_entry:\n"
+  "  mov  x0, x20\n"
+  "  blr  x19\n"
+  "  brk  #0\n"
+  ".size coro_platform_entry,.-coro_platform_entry\n"
+);
+
+static const int frame_words = 20;
+static const int reg_fn = 0;       // x19
+static const int reg_arg = 1;      // x20
 
-/*
- Credits
+#endif
 
-	Originally based on Edgar Toernig's Minimalistic cooperative multitasking
-	http://www.goron.de/~froese/
-	reorg by Steve Dekorte and Chis Double
-	Symbian and Cygwin support by Chis Double
-	Linux/PCC, Linux/Opteron, Irix and FreeBSD/Alpha, ucontext support by Austin Kurahone
-	FreeBSD/Intel support by Faried Nawaz
-	Mingw support by Pit Capitain
-	Visual C support by Daniel Vollmer
-	Solaris support by Manpreet Singh
-	Fibers support by Jonas Eschenburg
-	Ucontext arg support by Olivier Ansaldi
-	Ucontext x86-64 support by James Burgess and Jonathan Wright
-	Russ Cox for the newer portable ucontext implementions.
+// Build a frame in the top of the stack that coro_platform_switch will 'restore'
+static void* makeNativeFrame(void* stack, unsigned stack_size, void (*fn)(void*), void* start_arg) {
+  uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+  uintptr_t* sp;
+#if defined(__x86_64__)
+  // After the 'ret' to coro_platform_entry, rsp must be 16-aligned for the callq
+  sp = (uintptr_t*)(top - 16) - 1;
+  *sp = (uintptr_t)&coro_platform_entry;
+  sp -= frame_words;
+  for (int i = 0; i < frame_words; ++i)
+    sp[i] = 0;
+#elif defined(__aarch64__)
+  sp = (uintptr_t*)top - frame_words;
+  for (int i = 0; i < frame_words; ++i)
+    sp[i] = 0;
+  sp[11] = (uintptr_t)&coro_platform_entry;     // x30
+#endif
+  sp[reg_fn] = (uintptr_t)fn;
+  sp[reg_arg] = (uintptr_t)start_arg;
+  return sp;
+}
 
- Notes
+static TCoroPlatform::eBackend backend = TCoroPlatform::BACKEND_NATIVE;
 
-	This is the system dependent coro code.
-	Setup a jmp_buf so when we longjmp, it will invoke 'func' using 'stack'.
-	Important: 'func' must not return!
+#else
 
-	Usually done by setting the program counter and stack pointer of a new, empty stack.
-	If you're adding a new platform, look in the setjmp.h for PC and SP members
-	of the stack structure
+static TCoroPlatform::eBackend backend = TCoroPlatform::BACKEND_UCONTEXT;
 
-	If you don't see those members, Kentaro suggests writting a simple
-	test app that calls setjmp and dumps out the contents of the jmp_buf.
-	(The PC and SP should be in jmp_buf->__jmpbuf).
+#endif
 
-	Using something like GDB to be able to peek into register contents right
-	before the setjmp occurs would be helpful also.
+// ------------------------------------------------------------------
+// Stacks are reserved with mmap with a PROT_NONE guard page below them, and
+// recycled between coroutines. Only the top resident_bytes of a recycled
+// stack are kept. If the coroutine went deeper than that, which we know 
+// because it has overwritten the canary, the pages below are given back to the OS.
+namespace {
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stddef.h>
-#include <time.h>
-#include <setjmp.h>
-#include <stdarg.h>
-#include <string.h>
+  const uint64_t stack_canary = 0x57ac4ca4a21e57acull;
 
-#include "coro_platform.h"
-#include "taskimpl.h"
-
-#ifdef USE_VALGRIND
-#include <valgrind/valgrind.h>
-#define STACK_REGISTER(coro) \
-{ \
-	Coro *c = (coro); \
-		c->valgrindStackId = VALGRIND_STACK_REGISTER( \
-											 c->stack, \
-											 c->stack + c->requestedStackSize); \
-}
+  unsigned max_cached_stacks = 64;          // Per stack size
+  unsigned resident_bytes = 16 * 1024;
+  bool     measure_stacks = false;
 
-#define STACK_DEREGISTER(coro) \
-VALGRIND_STACK_DEREGISTER((coro)->valgrindStackId)
+  size_t pageSize() {
+    static size_t page_size = (size_t)::sysconf(_SC_PAGESIZE);
+    return page_size;
+  }
 
-#else
-#define STACK_REGISTER(coro)
-#define STACK_DEREGISTER(coro)
-#endif
+  size_t roundToPages(size_t nbytes) {
+    size_t page_size = pageSize();
+    return (nbytes + page_size - 1) & ~(page_size - 1);
+  }
 
-typedef struct CallbackBlock
-{
-	void *context;
-	CoroStartCallback *func;
-} CallbackBlock;
+  // Lowest address of the stack that we keep resident when recycled
+  uintptr_t residentLimit(void* stack, size_t size) {
+    uintptr_t top = (uintptr_t)stack + size;
+    if (resident_bytes >= size)
+      return (uintptr_t)stack;
+    return (top - resident_bytes) & ~(uintptr_t)(pageSize() - 1);
+  }
 
-static CallbackBlock globalCallbackBlock;
+  uint64_t* canaryOf(void* stack, size_t size) {
+    uintptr_t limit = residentLimit(stack, size);
+    if (limit <= (uintptr_t)stack)
+      return nullptr;
+    return (uint64_t*)limit - 1;
+  }
 
-Coro *Coro_new(void)
-{
-	Coro *self = (Coro *)malloc(sizeof(Coro));
-	self->requestedStackSize = CORO_DEFAULT_STACK_SIZE;
-	self->allocatedStackSize = 0;
-  self->isMain = 0;
-  self->stack = NULL;
+  // The deepest word written is the first one which is not 0, as the stack
+  // was zeroed. Reading the pages never touched doesn't make them resident
+  size_t usedBytes(void* stack, size_t size) {
+    auto canary = canaryOf(stack, size);
+    auto p = (const uint64_t*)stack;
+    auto end = (const uint64_t*)((char*)stack + size);
+    while (p < end && (*p == 0 || (p == canary && *p == stack_canary)))
+      ++p;
+    return (const char*)end - (const char*)p;
+  }
 
-#ifdef USE_FIBERS
-	self->fiber = NULL;
-#else
-	self->stack = NULL;
+  struct TStackPool {
+
+    struct TBucket {
+      size_t              size;
+      std::vector<void*>  stacks;
+    };
+    std::vector<TBucket>  buckets;
+
+    ~TStackPool() {
+      for (auto& b : buckets) {
+        for (auto s : b.stacks)
+          unmap(s, b.size);
+      }
+    }
+
+    TBucket& bucketOf(size_t size) {
+      for (auto& b : buckets) {
+        if (b.size == size)
+          return b;
+      }
+      buckets.push_back(TBucket{ size, std::vector<void*>() });
+      return buckets.back();
+    }
+
+    static void unmap(void* stack, size_t size) {
+      ::munmap((char*)stack - pageSize(), size + pageSize());
+    }
+
+    void* acquire(size_t size) {
+      size = roundToPages(size);
+      auto& b = bucketOf(size);
+      if (!b.stacks.empty()) {
+        void* stack = b.stacks.back();
+        b.stacks.pop_back();
+        return stack;
+      }
+
+      size_t guard = pageSize();
+      void* addr = ::mmap(nullptr, size + guard, PROT_READ | PROT_WRITE
+        , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+#ifdef MAP_STACK
+        | MAP_STACK
 #endif
-	return self;
-}
-
-void Coro_allocStackIfNeeded(Coro *self)
-{
-	if (self->stack && self->requestedStackSize < self->allocatedStackSize)
-	{
-		free(self->stack);
-		self->stack = NULL;
-		self->requestedStackSize = 0;
-	}
-
-	if (!self->stack)
-	{
-		self->stack = malloc(self->requestedStackSize + 16);
-		self->allocatedStackSize = self->requestedStackSize;
-		//printf("Coro_%p allocating stack size %i\n", (void *)self, self->requestedStackSize);
-		STACK_REGISTER(self);
-	}
+        , -1, 0);
+      if (addr == MAP_FAILED)
+        return nullptr;
+      // This fails when we run out of vm.max_map_count, as each guard page
+      // splits the mapping. Without the guard an overflow would go unnoticed
+      if (::mprotect(addr, guard, PROT_NONE) != 0) {
+        ::munmap(addr, size + guard);
+        return nullptr;
+      }
+      void* stack = (char*)addr + guard;
+      if (auto canary = canaryOf(stack, size))
+        *canary = stack_canary;
+      return stack;
+    }
+
+    void release(void* stack, size_t size) {
+      size = roundToPages(size);
+      auto& b = bucketOf(size);
+      if (b.stacks.size() >= max_cached_stacks) {
+        unmap(stack, size);
+        return;
+      }
+      // Zeroed for the next measure. The canary might go with it, and then
+      // the pages below are released anyway
+      if (measure_stacks) {
+        size_t used = usedBytes(stack, size);
+        memset((char*)stack + size - used, 0x00, used);
+      }
+      auto canary = canaryOf(stack, size);
+      if (canary && *canary != stack_canary) {
+        ::madvise(stack, residentLimit(stack, size) - (uintptr_t)stack, MADV_DONTNEED);
+        *canary = stack_canary;
+      }
+      b.stacks.push_back(stack);
+    }
+  };
+
+  thread_local TStackPool stack_pool;
+
+  // The context that has just finished, and whose stack is recycled once we are out of it
+  thread_local TCoroPlatform* exited = nullptr;
+
+  // makecontext can only pass int args, so the new context finds itself here
+  thread_local TCoroPlatform* ucontext_starting = nullptr;
+
+  void ucontextEntry() {
+    TCoroPlatform::entryPoint(ucontext_starting);
+  }
 }
 
-void Coro_free(Coro *self)
-{
-#ifdef USE_FIBERS
-	// If this coro has a fiber, delete it.
-	// Don't delete the main fiber. We don't want to commit suicide.
-	if (self->fiber && !self->isMain)
-	{
-		DeleteFiber(self->fiber);
-	}
+bool TCoroPlatform::setBackend(eBackend new_backend) {
+  if (contexts_created) {
+    if (new_backend == BACKEND_DEFAULT)
+#ifdef CORO_PLATFORM_NATIVE
+      new_backend = BACKEND_NATIVE;
 #else
-	STACK_DEREGISTER(self);
+      new_backend = BACKEND_UCONTEXT;
 #endif
-	if (self->stack)
-	{
-		free(self->stack);
-	}
-
-	//printf("Coro_%p io_free\n", (void *)self);
-
-	free(self);
+    return new_backend == backend;
+  }
+  switch (new_backend) {
+  case BACKEND_DEFAULT:
+#ifdef CORO_PLATFORM_NATIVE
+    backend = BACKEND_NATIVE;
+#else
+    backend = BACKEND_UCONTEXT;
+#endif
+    return true;
+#ifdef CORO_PLATFORM_NATIVE
+  case BACKEND_NATIVE:
+#endif
+  case BACKEND_UCONTEXT:
+    backend = new_backend;
+    return true;
+  default:
+    return false;
+  }
 }
 
-// stack
-
-void *Coro_stack(Coro *self)
-{
-	return self->stack;
+TCoroPlatform::eBackend TCoroPlatform::currentBackend() {
+  return backend;
 }
 
-size_t Coro_stackSize(Coro *self)
-{
-	return self->requestedStackSize;
+void TCoroPlatform::setStackPoolLimits(unsigned new_max_cached_stacks, unsigned new_resident_bytes) {
+  max_cached_stacks = new_max_cached_stacks;
+  resident_bytes = new_resident_bytes;
 }
 
-void Coro_setStackSize_(Coro *self, size_t sizeInBytes)
-{
-	self->requestedStackSize = sizeInBytes;
-	//self->stack = (void *)io_realloc(self->stack, sizeInBytes);
-	//printf("Coro_%p io_reallocating stack size %i\n", (void *)self, sizeInBytes);
+void TCoroPlatform::setStackMeasurement(bool enabled) {
+  measure_stacks = enabled;
 }
 
-#if __GNUC__ == 4
-uint8_t *Coro_CurrentStackPointer(void) __attribute__ ((noinline));
-#endif
-
-uint8_t *Coro_CurrentStackPointer(void)
-{
-	uint8_t a;
-	uint8_t *b = &a; // to avoid compiler warning about unused variables
-	return b;
+// The stack is taken from the pool in start(), and given back when it exits
+void TCoroPlatform::setStackSize(unsigned new_stack_size) {
+  assert(!is_main && !stack);
+  stack_size = new_stack_size < min_stack_size ? min_stack_size : new_stack_size;
 }
 
-size_t Coro_bytesLeftOnStack(Coro *self)
-{
-	unsigned char dummy;
-	ptrdiff_t p1 = (ptrdiff_t)(&dummy);
-	ptrdiff_t p2 = (ptrdiff_t)Coro_CurrentStackPointer();
-	int stackMovesUp = p2 > p1;
-	ptrdiff_t start = ((ptrdiff_t)self->stack);
-	ptrdiff_t end   = start + self->requestedStackSize;
-
-	if (stackMovesUp) // like x86
-	{
-		return end - p1;
-	}
-	else // like OSX on PPC
-	{
-		return p1 - start;
-	}
+unsigned TCoroPlatform::stackUsed() const {
+  assert(running == this && stack);
+  return (unsigned)usedBytes(stack, roundToPages(stack_size));
 }
 
-int Coro_stackSpaceAlmostGone(Coro *self)
-{
-	return Coro_bytesLeftOnStack(self) < CORO_STACK_SIZE_MIN;
+void TCoroPlatform::entryPoint(void* arg) {
+  auto self = static_cast<TCoroPlatform*>(arg);
+  recycleExited();
+  self->start_fn(self->start_arg);
+  // start_fn must exit to another context, not return
+  abort();
 }
 
-Coro* Coro_initializeMainCoro(Coro *self)
-{
-	self->isMain = 1;
-#ifdef USE_FIBERS
-	// We must convert the current thread into a fiber if it hasn't already been done.
-	if ((LPVOID) 0x1e00 == GetCurrentFiber()) // value returned when not a fiber
-	{
-		// Make this thread a fiber and set its data field to the main coro's address
-		ConvertThreadToFiber(self);
-	}
-	// Make the main coro represent the current fiber
-	self->fiber = GetCurrentFiber();
-#endif
-  return self;
+void TCoroPlatform::recycleExited() {
+  if (!exited)
+    return;
+  assert(exited->stack);
+  stack_pool.release(exited->stack, exited->stack_size);
+  exited->stack = nullptr;
+  exited = nullptr;
 }
 
-void Coro_startCoro_(Coro *self, Coro *other, void *context, CoroStartCallback *callback)
-{
-	CallbackBlock sblock;
-	CallbackBlock *block = &sblock;
-	//CallbackBlock *block = malloc(sizeof(CallbackBlock)); // memory leak
-	block->context = context;
-	block->func    = callback;
-	
-	Coro_allocStackIfNeeded(other);
-	Coro_setup(other, block);
-	Coro_switchTo_(self, other);
-}
+TCoroPlatform::TCoroPlatform()
+  : fiber(nullptr)
+  , is_main(false)
+  , stack_size( 128 * 1024 )
+  , start_fn(nullptr)
+  , start_arg(nullptr)
+  , stack(nullptr)
+{}
 
-/*
-void Coro_startCoro_(Coro *self, Coro *other, void *context, CoroStartCallback *callback)
-{
-	globalCallbackBlock.context = context;
-	globalCallbackBlock.func    = callback;
-	Coro_allocStackIfNeeded(other);
-	Coro_setup(other, &globalCallbackBlock);
-	Coro_switchTo_(self, other);
+TCoroPlatform::~TCoroPlatform() {
+  if (backend == BACKEND_UCONTEXT && fiber)
+    delete (ucontext_t*)fiber;
+  // The thread pool might be already gone
+  if (stack)
+    TStackPool::unmap(stack, roundToPages(stack_size));
 }
-*/
-
 
-// old code
-
-/*
- // APPLE coros are handled by PortableUContext now
-#elif defined(_BSD_PPC_SETJMP_H_)
-
-#define buf (self->env)
-#define setjmp  _setjmp
-#define longjmp _longjmp
-
- void Coro_setup(Coro *self, void *arg)
- {
-	 size_t *sp = (size_t *)(((intptr_t)Coro_stack(self) + Coro_stackSize(self) - 64 + 15) & ~15);
-
-	 setjmp(buf);
-
-	 //printf("self = %p\n", self);
-	 //printf("sp = %p\n", sp);
-	 buf[0]  = (int)sp;
-	 buf[21] = (int)Coro_Start;
-	 //sp[-4] = (size_t)self; // for G5 10.3
-	 //sp[-6] = (size_t)self; // for G4 10.4
-
-	 //printf("self = %p\n", (void *)self);
-	 //printf("sp = %p\n", sp);
- }
-
-#elif defined(_BSD_I386_SETJMP_H)
-
-#define buf (self->env)
-
- void Coro_setup(Coro *self, void *arg)
- {
-	 size_t *sp = (size_t *)((intptr_t)Coro_stack(self) + Coro_stackSize(self));
-
-	 setjmp(buf);
-
-	 buf[9] = (int)(sp); // esp
-	 buf[12] = (int)Coro_Start; // eip
-						   //buf[8] = 0; // ebp
- }
- */
-
-/* Solaris supports ucontext - so we don't need this stuff anymore
-
-void Coro_setup(Coro *self, void *arg)
-{
-	// this bit goes before the setjmp call
-	// Solaris 9 Sparc with GCC
-#if defined(__SVR4) && defined (__sun)
-#if defined(_JBLEN) && (_JBLEN == 12) && defined(__sparc)
-#if defined(_LP64) || defined(_I32LPx)
-#define JBTYPE long
-	JBTYPE x;
-#else
-#define JBTYPE int
-	JBTYPE x;
-	asm("ta 3"); // flush register window
-#endif
-
-#define SUN_STACK_END_INDEX   1
-#define SUN_PROGRAM_COUNTER   2
-#define SUN_STACK_START_INDEX 3
-
-	// Solaris 9 i386 with GCC
-#elif defined(_JBLEN) && (_JBLEN == 10) && defined(__i386)
-#if defined(_LP64) || defined(_I32LPx)
-#define JBTYPE long
-					JBTYPE x;
-#else
-#define JBTYPE int
-					JBTYPE x;
-#endif
-#define SUN_PROGRAM_COUNTER 5
-#define SUN_STACK_START_INDEX 3
-#define SUN_STACK_END_INDEX 4
-#endif
+void TCoroPlatform::switchTo(TCoroPlatform* other) {
+  assert(other);
+  assert(other->fiber);
+  assert(running == this);
+  running = other;
+#ifdef CORO_PLATFORM_NATIVE
+  if (backend == BACKEND_NATIVE)
+    coro_platform_switch(&fiber, other->fiber);
+  else
 #endif
-					*/
-
-/* Irix supports ucontext - so we don't need this stuff anymore
-
-#elif defined(sgi) && defined(_IRIX4_SIGJBLEN) // Irix/SGI
-
-void Coro_setup(Coro *self, void *arg)
-{
-	setjmp(buf);
-	buf[JB_SP] = (__uint64_t)((char *)stack + stacksize - 8);
-	buf[JB_PC] = (__uint64_t)Coro_Start;
+  // glibc saves and restores the signal mask here, one sigprocmask syscall per switch
+  ::swapcontext((ucontext_t*)fiber, (ucontext_t*)other->fiber);
+  // We are back, maybe from a context that has just finished
+  recycleExited();
 }
-*/
-
-/* Linux supports ucontext - so we don't need this stuff anymore
-
-#elif defined(linux)
-// Various flavors of Linux.
-#if defined(JB_GPR1)
-// Linux/PPC
-buf->__jmpbuf[JB_GPR1] = ((int) stack + stacksize - 64 + 15) & ~15;
-buf->__jmpbuf[JB_LR]   = (int) Coro_Start;
-return;
-
-#elif defined(JB_RBX)
-// Linux/Opteron
-buf->__jmpbuf[JB_RSP] = (long int )stack + stacksize;
-buf->__jmpbuf[JB_PC]  = Coro_Start;
-return;
-
-#elif defined(JB_SP)
-
-// Linux/x86 with glibc2
-buf->__jmpbuf[JB_SP] = (int)stack + stacksize;
-buf->__jmpbuf[JB_PC] = (int)Coro_StartWithArg;
-// Push the argument on the stack (stack grows downwards)
-// note: stack is stacksize + 16 bytes long
-((int *)stack)[stacksize/sizeof(int) + 1] = (int)self;
-return;
-
-#elif defined(_I386_JMP_BUF_H)
-// x86-linux with libc5
-buf->__sp = (int)stack + stacksize;
-buf->__pc = Coro_Start;
-return;
-
-#elif defined(__JMP_BUF_SP)
-// arm-linux on the sharp zauras
-buf->__jmpbuf[__JMP_BUF_SP]   = (int)stack + stacksize;
-buf->__jmpbuf[__JMP_BUF_SP+1] = (int)Coro_Start;
-return;
 
-#else
-
-*/
-
-
-/* Windows supports fibers - so we don't need this stuff anymore
-
-#elif defined(__MINGW32__)
-
-void Coro_setup(Coro *self, void *arg)
-{
-	setjmp(buf);
-	buf[4] = (int)((unsigned char *)stack + stacksize - 16);   // esp
-	buf[5] = (int)Coro_Start; // eip
+void TCoroPlatform::exitTo(TCoroPlatform* other) {
+  assert(!exited);
+  exited = this;
+  switchTo(other);
 }
 
-#elif defined(_MSC_VER)
-
-void Coro_setup(Coro *self, void *arg)
-{
-	setjmp(buf);
-	// win32 visual c
-	// should this be the same as __MINGW32__?
-	buf[4] = (int)((unsigned char *)stack + stacksize - 16);  // esp
-	buf[5] = (int)Coro_Start; // eip
+bool TCoroPlatform::initAsMain() {
+  assert(!is_main);
+  is_main = true;
+  running = this;
+  // Native: the sp will be saved the first time we switch to another context
+  if (backend == BACKEND_UCONTEXT)
+    fiber = new ucontext_t;
+  contexts_created = true;
+  return true;
 }
-*/
-
 
-/* FreeBSD supports ucontext - so we don't need this stuff anymore
-
-#elif defined(__FreeBSD__)
-// FreeBSD.
-#if defined(_JBLEN) && (_JBLEN == 81)
-// FreeBSD/Alpha
-buf->_jb[2] = (long)Coro_Start;     // sc_pc
-buf->_jb[26+4] = (long)Coro_Start;  // sc_regs[R_RA]
-buf->_jb[27+4] = (long)Coro_Start;  // sc_regs[R_T12]
-buf->_jb[30+4] = (long)(stack + stacksize); // sc_regs[R_SP]
-return;
-
-#elif defined(_JBLEN)
-// FreeBSD on IA32
-buf->_jb[2] = (long)(stack + stacksize);
-buf->_jb[0] = (long)Coro_Start;
-return;
-
-#else
-Coro_UnsupportedPlatformError();
-#endif
-*/
-
-/* NetBSD supports ucontext - so we don't need this stuff anymore
-
-#elif defined(__NetBSD__)
-
-void Coro_setup(Coro *self, void *arg)
-{
-	setjmp(buf);
-#if defined(_JB_ATTRIBUTES)
-	// NetBSD i386
-	buf[2] = (long)(stack + stacksize);
-	buf[0] = (long)Coro_Start;
-#else
-	Coro_UnsupportedPlatformError();
-#endif
+bool TCoroPlatform::allocStack() {
+  assert(!is_main);
+  if (!stack)
+    stack = stack_pool.acquire(stack_size);
+  return stack != nullptr;
 }
-*/
 
-/* Sun supports ucontext - so we don't need this stuff anymore
+void TCoroPlatform::start(TStartFn fn, void* new_start_arg) {
+  assert(!is_main);
+  start_fn = fn;
+  start_arg = new_start_arg;
 
-// Solaris supports ucontext - so we don't need this stuff anymore
+  bool allocated = allocStack();
+  assert(allocated);
+  (void)allocated;
+  contexts_created = true;
 
-void Coro_setup(Coro *self, void *arg)
-{
-	// this bit goes before the setjmp call
-	// Solaris 9 Sparc with GCC
-#if defined(__SVR4) && defined (__sun)
-#if defined(_JBLEN) && (_JBLEN == 12) && defined(__sparc)
-#if defined(_LP64) || defined(_I32LPx)
-#define JBTYPE long
-	JBTYPE x;
-#else
-#define JBTYPE int
-	JBTYPE x;
-	asm("ta 3"); // flush register window
+#ifdef CORO_PLATFORM_NATIVE
+  if (backend == BACKEND_NATIVE) {
+    fiber = makeNativeFrame(stack, stack_size, &entryPoint, this);
+  }
+  else
 #endif
+  {
+    if (!fiber)
+      fiber = new ucontext_t;
+    ucontext_t* ctx = (ucontext_t*)fiber;
+    ::getcontext(ctx);
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = stack_size;
+    ctx->uc_link = nullptr;
+    ::makecontext(ctx, &ucontextEntry, 0);
+    ucontext_starting = this;
+  }
 
-#define SUN_STACK_END_INDEX   1
-#define SUN_PROGRAM_COUNTER   2
-#define SUN_STACK_START_INDEX 3
+  assert(running);
+  running->switchTo(this);
+}
 
-	// Solaris 9 i386 with GCC
-#elif defined(_JBLEN) && (_JBLEN == 10) && defined(__i386)
-#if defined(_LP64) || defined(_I32LPx)
-#define JBTYPE long
-					JBTYPE x;
-#else
-#define JBTYPE int
-					JBTYPE x;
-#endif
-#define SUN_PROGRAM_COUNTER 5
-#define SUN_STACK_START_INDEX 3
-#define SUN_STACK_END_INDEX 4
-#endif
 #endif
 
+/*
+ Credits
 
-#elif defined(__SVR4) && defined(__sun)
-					// Solaris
-#if defined(SUN_PROGRAM_COUNTER)
-					// SunOS 9
-					buf[SUN_PROGRAM_COUNTER] = (JBTYPE)Coro_Start;
-
-					x = (JBTYPE)stack;
-					while ((x % 8) != 0) x --; // align on an even boundary
-					buf[SUN_STACK_START_INDEX] = (JBTYPE)x;
-					x = (JBTYPE)((JBTYPE)stack-stacksize / 2 + 15);
-					while ((x % 8) != 0) x ++; // align on an even boundary
-					buf[SUN_STACK_END_INDEX] = (JBTYPE)x;
-
-					*/
-
-
-
+	Originally based on Edgar Toernig's Minimalistic cooperative multitasking
+	http://www.goron.de/~froese/
+	reorg by Steve Dekorte and Chis Double
+	Symbian and Cygwin support by Chis Double
+	Linux/PCC, Linux/Opteron, Irix and FreeBSD/Alpha, ucontext support by Austin Kurahone
+	FreeBSD/Intel support by Faried Nawaz
+	Mingw support by Pit Capitain
+	Visual C support by Daniel Vollmer
+	Solaris support by Manpreet Singh
+	Fibers support by Jonas Eschenburg
+	Ucontext arg support by Olivier Ansaldi
+	Ucontext x86-64 support by James Burgess and Jonathan Wright
+	Russ Cox for the newer portable ucontext implementions.
+*/
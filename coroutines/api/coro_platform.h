@@ -1,23 +1,95 @@
 #ifndef INC_COROUTINES_API_PLATFORM_H_
 #define INC_COROUTINES_API_PLATFORM_H_
 
+// Backends available are selected at compile time:
+//   _WIN32                          -> Win32 fibers
+//   Linux on x86-64 / AArch64       -> Hand written asm switch, only callee-saved regs
+//   Any other posix                 -> ucontext
+// In posix the ucontext backend can also be selected at runtime, before any
+// coroutine has been created.
+#if defined(_WIN32)
+  #define CORO_PLATFORM_FIBERS
+#elif defined(__linux__) && ( defined(__x86_64__) || defined(__aarch64__) )
+  #define CORO_PLATFORM_NATIVE
+  #define CORO_PLATFORM_UCONTEXT
+#elif defined(__unix__) || defined(__APPLE__)
+  #define CORO_PLATFORM_UCONTEXT
+#else
+  #error "Unsupported platform for TCoroPlatform"
+#endif
+
+// Code that reads thread_locals after a switch, where the context might
+// have been resumed by another thread
+#ifdef _MSC_VER
+  #define CORO_NOINLINE __declspec(noinline)
+#else
+  #define CORO_NOINLINE __attribute__((noinline))
+#endif
+
 class TCoroPlatform {
-  void*       fiber;
+  typedef void (TStartFn)(void *);
+
+  void*       fiber;        // Fibers: the fiber. Native: the saved stack pointer. ucontext: the ucontext_t
   bool        is_main;
   unsigned    stack_size;
-  
-  typedef void (TStartFn)(void *);
+  TStartFn*   start_fn;
+  void*       start_arg;
+#ifndef CORO_PLATFORM_FIBERS
+  void*       stack;        // Lowest address of the stack memory. Owned by the stack pool while not running
+
+  CORO_NOINLINE static void recycleExited();
+#endif
 
 public:
+  enum eBackend {
+    BACKEND_DEFAULT         // The fastest available in this platform
+  , BACKEND_NATIVE          // Fibers in win32, asm switch in linux
+  , BACKEND_UCONTEXT        // getcontext/makecontext/swapcontext
+  };
+
+  // Returns false if the backend is not available in this platform, or if
+  // there are already contexts created with another backend
+  static bool setBackend(eBackend new_backend);
+  static eBackend currentBackend();
+
+  // Finished coroutines give their stacks back to a per thread pool. The pool keeps
+  // up to max_cached_stacks per stack size, and only the top resident_bytes of each
+  // of them are kept in memory.
+  static void setStackPoolLimits(unsigned max_cached_stacks, unsigned resident_bytes);
+
+  // First code run by all the contexts. Not to be called by the user
+  static void entryPoint(void* self);
+
   TCoroPlatform();
   ~TCoroPlatform();
 
+  // Smaller stack sizes are raised to this. The first frame, the canary and
+  // the scheduler code run by each context need some room above the guard page
+  static const unsigned min_stack_size = 16 * 1024;
+
+  // Used from the next start(). Rounded up to whole pages
+  void setStackSize(unsigned new_stack_size);
+  unsigned stackSize() const { return stack_size; }
+
+  // While enabled, recycled stacks are zeroed again down to the deepest point
+  // used, like the new ones, so stackUsed can find it. Stacks used before it
+  // was enabled are measured as fully used until they are recycled again
+  static void setStackMeasurement(bool enabled);
+  // How deep this context has gone into its stack. Must be called from it
+  unsigned stackUsed() const;
+
+  // Gets the stack for the next start(), if it doesn't have one yet. Returns
+  // false when it can't be allocated
+  bool allocStack();
   void start(TStartFn fn, void* start_arg);
   void switchTo(TCoroPlatform* other);
+  // Like switchTo, but this context has finished, and will not be resumed 
+  // until the next start()
+  void exitTo(TCoroPlatform* other);
 
   bool isMain() const { return is_main; }
   bool initAsMain();
 
 };
 
-#endif
\ No newline at end of file
+#endif
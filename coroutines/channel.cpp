@@ -3,12 +3,23 @@
 
 namespace Coroutines {
 
+  void TChannelBase::wakeUpN(TList& waiters, size_t n) {
+    while (n--) {
+      auto we = waiters.detachFirst< TWatchedEvent >();
+      if (!we)
+        break;
+      wakeUp(we);
+    }
+  }
+
   void TChannel::push(const void* user_data, size_t user_data_size) {
+    internal::TScopedLock lock;
     assert(user_data);
     assert(data);
     assert(nelems_stored < max_elems);
     assert(user_data_size == bytes_per_elem);
     assert(!closed());
+    assert(!push_reserved);
     if (bytes_per_elem)
       memcpy(addrOfItem((first_idx + nelems_stored) % max_elems), user_data, bytes_per_elem);
     ++nelems_stored;
@@ -23,26 +34,191 @@ namespace Coroutines {
   }
 
   void TChannel::pull(void* user_data, size_t user_data_size) {
+    internal::TScopedLock lock;
     assert(data);
     assert(user_data);
     assert(nelems_stored > 0);
+    assert(!pull_reserved);
     assert(user_data_size == bytes_per_elem);
     if (bytes_per_elem)
       memcpy(user_data, addrOfItem(first_idx), bytes_per_elem);
     --nelems_stored;
     first_idx = (first_idx + 1) % max_elems;
 
-    // For each elem push, wakeup one waiter
+    // For each elem pulled, wakeup one waiter. If it's waiting in push, its
+    // item goes into the slot just freed, so it does not need to retry
     auto we = waiting_for_push.detachFirst< TWatchedEvent >();
     if (we) {
       assert(we->channel.channel == this);
       assert(we->event_type == EVT_CHANNEL_CAN_PUSH);
+      if (we->channel.handoff && !push_reserved && !closed()) {
+        assert(we->channel.data_size == bytes_per_elem);
+        if (bytes_per_elem)
+          memcpy(addrOfItem((first_idx + nelems_stored) % max_elems), we->channel.data_addr, bytes_per_elem);
+        ++nelems_stored;
+        we->channel.handed_off = true;
+      }
       wakeUp(we);
     }
+  }
 
+  // ----------------------------------------------------------
+  bool TChannel::pushToWaiter(const void* user_data, size_t user_data_size) {
+    internal::TScopedLock lock;
+    assert(user_data);
+    assert(user_data_size == bytes_per_elem);
+    assert(!closed());
+    auto we = handOffWaiter(waiting_for_pull);
+    if (!we)
+      return false;
+    assert(we->channel.data_size == bytes_per_elem);
+    if (bytes_per_elem)
+      memcpy(we->channel.data_addr, user_data, bytes_per_elem);
+    handedOff(waiting_for_pull, we);
+    return true;
+  }
+
+  bool TChannel::pullFromWaiter(void* user_data, size_t user_data_size) {
+    internal::TScopedLock lock;
+    assert(user_data);
+    assert(user_data_size == bytes_per_elem);
+    auto we = handOffWaiter(waiting_for_push);
+    if (!we)
+      return false;
+    assert(we->channel.data_size == bytes_per_elem);
+    if (bytes_per_elem)
+      memcpy(user_data, we->channel.data_addr, bytes_per_elem);
+    handedOff(waiting_for_push, we);
+    return true;
+  }
+
+  // ----------------------------------------------------------
+  // The items are contiguous in the ring, except when they wrap around the
+  // end, so they are moved with at most two memcpy
+  size_t TChannel::pushN(const void* items, size_t nitems, size_t bytes_per_item) {
+    internal::TScopedLock lock;
+    assert(items || nitems == 0);
+    assert(data);
+    assert(bytes_per_item == bytes_per_elem);
+    assert(!closed());
+    assert(!push_reserved);
+    size_t n = max_elems - nelems_stored;
+    if (n > nitems)
+      n = nitems;
+    if (n == 0)
+      return 0;
+    size_t idx = (first_idx + nelems_stored) % max_elems;
+    size_t n1 = max_elems - idx;
+    if (n1 > n)
+      n1 = n;
+    if (bytes_per_elem) {
+      memcpy(addrOfItem(idx), items, n1 * bytes_per_elem);
+      if (n > n1)
+        memcpy(data, (const u8*)items + n1 * bytes_per_elem, (n - n1) * bytes_per_elem);
+    }
+    nelems_stored += n;
+    wakeUpN(waiting_for_pull, n);
+    return n;
+  }
+
+  size_t TChannel::pullN(void* items, size_t max_items, size_t bytes_per_item) {
+    internal::TScopedLock lock;
+    assert(items || max_items == 0);
+    assert(data);
+    assert(bytes_per_item == bytes_per_elem);
+    assert(!pull_reserved);
+    size_t n = nelems_stored;
+    if (n > max_items)
+      n = max_items;
+    if (n == 0)
+      return 0;
+    size_t n1 = max_elems - first_idx;
+    if (n1 > n)
+      n1 = n;
+    if (bytes_per_elem) {
+      memcpy(items, addrOfItem(first_idx), n1 * bytes_per_elem);
+      if (n > n1)
+        memcpy((u8*)items + n1 * bytes_per_elem, data, (n - n1) * bytes_per_elem);
+    }
+    nelems_stored -= n;
+    first_idx = (first_idx + n) % max_elems;
+    wakeUpN(waiting_for_push, n);
+    return n;
+  }
+
+  // ----------------------------------------------------------
+  void* TChannel::beginPush() {
+    internal::TScopedLock lock;
+    assert(data);
+    assert(max_elems > 0);
+    while (!canPush() && !closed()) {
+      TWatchedEvent evt(this, EVT_CHANNEL_CAN_PUSH);
+      wait(&evt, 1);
+    }
+    if (closed())
+      return nullptr;
+    push_reserved = true;
+    return addrOfItem((first_idx + nelems_stored) % max_elems);
+  }
+
+  // Published even if the channel has been closed in between
+  void TChannel::commitPush() {
+    internal::TScopedLock lock;
+    assert(push_reserved);
+    push_reserved = false;
+    ++nelems_stored;
+
+    auto we = waiting_for_pull.detachFirst< TWatchedEvent >();
+    if (we)
+      wakeUp(we);
+    // Someone else could be waiting for our reservation to end
+    if (!full()) {
+      we = waiting_for_push.detachFirst< TWatchedEvent >();
+      if (we)
+        wakeUp(we);
+    }
+  }
+
+  const void* TChannel::beginPull() {
+    internal::TScopedLock lock;
+    assert(data);
+    assert(max_elems > 0);
+    while (!canPull()) {
+      if (closed() && empty())
+        return nullptr;
+      TWatchedEvent evt(this, EVT_CHANNEL_CAN_PULL);
+      wait(&evt, 1);
+    }
+    pull_reserved = true;
+    return addrOfItem(first_idx);
+  }
+
+  void TChannel::endPull() {
+    internal::TScopedLock lock;
+    assert(pull_reserved);
+    assert(nelems_stored > 0);
+    pull_reserved = false;
+    --nelems_stored;
+    first_idx = (first_idx + 1) % max_elems;
+
+    auto we = waiting_for_push.detachFirst< TWatchedEvent >();
+    if (we)
+      wakeUp(we);
+    // Once closed and empty, all the readers left must know it
+    if (closed() && empty()) {
+      while (auto we = waiting_for_pull.detachFirst< TWatchedEvent >())
+        wakeUp(we);
+    }
+    else if (!empty()) {
+      we = waiting_for_pull.detachFirst< TWatchedEvent >();
+      if (we)
+        wakeUp(we);
+    }
   }
 
-  void TChannel::close() { 
+  // ----------------------------------------------------------
+  void TChannelBase::close() { 
+    internal::TScopedLock lock;
     is_closed = true; 
     // Wake up all threads waiting for me...
     // Waiting for pushing...
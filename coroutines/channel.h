@@ -4,24 +4,38 @@
 #include <cinttypes>
 #include <cstring>         // memcpy
 #include "list.h"
+#include "coroutines.h"
 
 namespace Coroutines {
 
   typedef uint8_t u8;
 
   // ----------------------------------------
-  class TChannel {
-    size_t bytes_per_elem;
+  // The state shared by all the channels, which is what wait() checks
+  class TChannelBase {
+  protected:
     size_t max_elems;
     size_t nelems_stored;
     size_t first_idx;
-    u8*    data;
     bool   is_closed;
+    bool   push_reserved;     // Between beginPush and commitPush
+    bool   pull_reserved;     // Between beginPull and endPull
 
-    u8* addrOfItem(size_t idx) {
-      assert(data);
-      assert(idx < max_elems);
-      return data + idx * bytes_per_elem;
+    // Each item moved can satisfy one waiter
+    static void wakeUpN(TList& waiters, size_t n);
+
+    // The first waiter, if it lets us move its item directly from/to its
+    // data_addr. Only while the buffer is empty, or the items would be reordered
+    TWatchedEvent* handOffWaiter(TList& waiters) const {
+      if (!empty() || waiters.empty())
+        return nullptr;
+      auto we = static_cast<TWatchedEvent*>(waiters.first);
+      return we->channel.handoff ? we : nullptr;
+    }
+    static void handedOff(TList& waiters, TWatchedEvent* we) {
+      waiters.detach(we);
+      we->channel.handed_off = true;
+      wakeUp(we);
     }
 
   public:
@@ -29,22 +43,63 @@ namespace Coroutines {
     TList  waiting_for_pull;
 
   public:
-    TChannel() : bytes_per_elem(0), max_elems(0), nelems_stored(0), first_idx(0), data(nullptr), is_closed(false) { }
-    TChannel(size_t new_max_elems, size_t new_bytes_per_elem) {
+    TChannelBase(size_t new_max_elems = 0) 
+      : max_elems(new_max_elems), nelems_stored(0), first_idx(0)
+      , is_closed(false), push_reserved(false), pull_reserved(false) { }
+    bool closed() const { return is_closed; }
+    bool empty() const { return nelems_stored == 0; }
+    bool full() const { return nelems_stored == max_elems; }
+    size_t size() const { return nelems_stored; }
+    size_t capacity() const { return max_elems; }
+    void close();
+
+    // Only one reservation of each kind at a time, the others wait for it
+    bool canPush() const { return !full() && !push_reserved; }
+    bool canPull() const { return !empty() && !pull_reserved; }
+  };
+
+  // ----------------------------------------
+  // Items of any type, stored as bytes_per_elem raw bytes. With 0 max_elems
+  // it's a rendezvous channel: push waits for a pull and the item is copied
+  // directly from one coroutine to the other
+  class TChannel : public TChannelBase {
+    size_t bytes_per_elem;
+    u8*    data;
+
+    u8* addrOfItem(size_t idx) {
+      assert(data);
+      assert(idx < max_elems);
+      return data + idx * bytes_per_elem;
+    }
+
+  public:
+    TChannel() : bytes_per_elem(0), data(nullptr) { }
+    TChannel(size_t new_max_elems, size_t new_bytes_per_elem) : TChannelBase(new_max_elems) {
       bytes_per_elem = new_bytes_per_elem;
-      max_elems = new_max_elems;
-      nelems_stored = 0;
-      first_idx = 0;
-      is_closed = false;
       data = new u8[bytes_per_elem * max_elems];
     }
     void push(const void* user_data, size_t user_data_size);
     void pull(void* user_data, size_t user_data_size);
-    bool closed() const { return is_closed; }
-    bool empty() const { return nelems_stored == 0; }
-    bool full() const { return nelems_stored == max_elems; }
-    void close();
+    // Copy as many items as fit/are stored, up to nitems, and return how many
+    size_t pushN(const void* items, size_t nitems, size_t bytes_per_item);
+    size_t pullN(void* items, size_t max_items, size_t bytes_per_item);
     size_t bytesPerElem() const { return bytes_per_elem; }
+
+    // Copy the item directly to/from a coroutine waiting in pull/push, and
+    // wake it up. False if there is none, or the buffer is not empty
+    bool pushToWaiter(const void* user_data, size_t user_data_size);
+    bool pullFromWaiter(void* user_data, size_t user_data_size);
+
+    // Zero-copy access to the slots. beginPush waits for a free slot and
+    // returns its address, so the item can be built in place. It's not seen
+    // by the readers until commitPush. Returns null if the channel is closed.
+    // beginPull waits for an item and returns its address, which is valid 
+    // until endPull releases the slot. Returns null if closed and empty.
+    // Must be called from a coroutine
+    void* beginPush();
+    void  commitPush();
+    const void* beginPull();
+    void  endPull();
   };
 
   // -----------------------------------------------------
@@ -52,13 +107,18 @@ namespace Coroutines {
   bool pull(TChannel* ch, TObj& obj) {
     assert(ch);
     assert(&obj);
-    while (ch->empty() && !ch->closed()) {
+    internal::TScopedLock lock;
+    while (!ch->canPull()) {
+      if (ch->pullFromWaiter(&obj, sizeof(obj)))
+        return true;
+      if (ch->closed() && ch->empty())
+        return false;
       TWatchedEvent evt(ch, obj, EVT_CHANNEL_CAN_PULL);
+      evt.channel.handoff = true;
       wait(&evt, 1);
+      if (evt.channel.handed_off)
+        return true;
     }
-
-    if (ch->closed() && ch->empty())
-      return false;
     ch->pull(&obj, sizeof(obj));
     return true;
   }
@@ -67,14 +127,71 @@ namespace Coroutines {
   bool push(TChannel* ch, const TObj& obj) {
     assert(ch);
     assert(&obj);
-    while (ch->full() && !ch->closed()) {
+    internal::TScopedLock lock;
+    while (!ch->closed()) {
+      // Someone is already waiting for it
+      if (ch->pushToWaiter(&obj, sizeof(obj)))
+        return true;
+      if (ch->canPush()) {
+        ch->push(&obj, sizeof(obj));
+        return true;
+      }
       TWatchedEvent evt(ch, obj, EVT_CHANNEL_CAN_PUSH);
+      evt.channel.handoff = true;
       wait(&evt, 1);
+      if (evt.channel.handed_off)
+        return true;
     }
-    if (ch->closed())
-      return false;
-    ch->push(&obj, sizeof(obj));
-    return true;
+    return false;
+  }
+
+  // Push all the items in [begin,end), waiting for room as required.
+  // Returns how many were pushed, less than all if the channel gets closed
+  template< typename TObj >
+  size_t push(TChannel* ch, const TObj* begin, const TObj* end) {
+    assert(ch);
+    assert(begin <= end);
+    internal::TScopedLock lock;
+    size_t npushed = 0;
+    // Without a buffer the items go one by one
+    if (ch->capacity() == 0) {
+      while (begin < end && push(ch, *begin)) {
+        ++begin;
+        ++npushed;
+      }
+      return npushed;
+    }
+    while (begin < end) {
+      while (!ch->canPush() && !ch->closed()) {
+        TWatchedEvent evt(ch, *begin, EVT_CHANNEL_CAN_PUSH);
+        wait(&evt, 1);
+      }
+      if (ch->closed())
+        break;
+      size_t n = ch->pushN(begin, end - begin, sizeof(TObj));
+      begin += n;
+      npushed += n;
+    }
+    return npushed;
+  }
+
+  // Waits for at least one item, and pulls up to max_items of the ones stored.
+  // Returns how many were pulled, 0 only when the channel is closed and empty
+  template< typename TObj >
+  size_t pull(TChannel* ch, TObj* out, size_t max_items) {
+    assert(ch);
+    assert(out);
+    assert(max_items > 0);
+    internal::TScopedLock lock;
+    if (ch->capacity() == 0)
+      return pull(ch, *out) ? 1 : 0;
+    while (!ch->canPull()) {
+      if (ch->closed() && ch->empty())
+        return 0;
+      TWatchedEvent evt(ch, *out, EVT_CHANNEL_CAN_PULL);
+      wait(&evt, 1);
+    }
+    return ch->pullN(out, max_items, sizeof(TObj));
   }
 
 
@@ -0,0 +1,145 @@
+#include "concurrent_channel.h"
+#include "coroutines.h"
+#include <climits>         // INT_MAX
+#include <cstring>         // memcpy
+
+namespace Coroutines {
+
+  TConcurrentChannel::TConcurrentChannel(size_t new_max_elems, size_t new_bytes_per_elem)
+    : bytes_per_elem(new_bytes_per_elem)
+    , is_closed(false)
+    , push_pos(0)
+    , pull_pos(0)
+    , npush_waiters(0)
+    , npull_waiters(0)
+  {
+    assert(new_max_elems > 0);
+    max_elems = 1;
+    while (max_elems < new_max_elems)
+      max_elems <<= 1;
+    mask = max_elems - 1;
+    // Slot i can be pushed when its seq is the push position i
+    seqs = new std::atomic<size_t>[max_elems];
+    for (size_t i = 0; i < max_elems; ++i)
+      seqs[i].store(i, std::memory_order_relaxed);
+    data = new u8[bytes_per_elem * max_elems];
+  }
+
+  TConcurrentChannel::~TConcurrentChannel() {
+    internal::cancelChannelWakes(this);
+    delete[] seqs;
+    delete[] data;
+  }
+
+  // -----------------------------------------------------
+  bool TConcurrentChannel::tryPush(const void* user_data, size_t user_data_size) {
+    assert(user_data);
+    assert(user_data_size == bytes_per_elem);
+    if (closed())
+      return false;
+
+    size_t pos = push_pos.load(std::memory_order_relaxed);
+    while (true) {
+      size_t seq = seqs[pos & mask].load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+        return false;             // Full
+      else
+        pos = push_pos.load(std::memory_order_relaxed);
+    }
+
+    if (bytes_per_elem)
+      memcpy(addrOfItem(pos & mask), user_data, bytes_per_elem);
+    // Now it can be pulled
+    seqs[pos & mask].store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fetch_add of the waiter, which checks the channel again
+    // after registering. Either we see it, or it sees our item
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (npull_waiters.load(std::memory_order_relaxed) > 0)
+      wakeUpOne(waiting_for_pull);
+    return true;
+  }
+
+  // -----------------------------------------------------
+  bool TConcurrentChannel::tryPull(void* user_data, size_t user_data_size) {
+    assert(user_data);
+    assert(user_data_size == bytes_per_elem);
+
+    size_t pos = pull_pos.load(std::memory_order_relaxed);
+    while (true) {
+      size_t seq = seqs[pos & mask].load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (pull_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+        return false;             // Empty
+      else
+        pos = pull_pos.load(std::memory_order_relaxed);
+    }
+
+    if (bytes_per_elem)
+      memcpy(user_data, addrOfItem(pos & mask), bytes_per_elem);
+    // The slot can be pushed again in the next round
+    seqs[pos & mask].store(pos + max_elems, std::memory_order_release);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (npush_waiters.load(std::memory_order_relaxed) > 0)
+      wakeUpOne(waiting_for_push);
+    return true;
+  }
+
+  // -----------------------------------------------------
+  bool TConcurrentChannel::empty() const {
+    size_t pos = pull_pos.load(std::memory_order_acquire);
+    size_t seq = seqs[pos & mask].load(std::memory_order_acquire);
+    return (intptr_t)seq - (intptr_t)(pos + 1) < 0;
+  }
+
+  bool TConcurrentChannel::full() const {
+    size_t pos = push_pos.load(std::memory_order_acquire);
+    size_t seq = seqs[pos & mask].load(std::memory_order_acquire);
+    return (intptr_t)seq - (intptr_t)pos < 0;
+  }
+
+  // -----------------------------------------------------
+  void TConcurrentChannel::wakeUpOne(TList& waiters) {
+    eEventType evt = (&waiters == &waiting_for_pull) ? EVT_CONCURRENT_CAN_PULL : EVT_CONCURRENT_CAN_PUSH;
+    if (internal::isForeignThread())
+      internal::postChannelWake(this, evt, 1);
+    else
+      wakeUpWaiters(evt, 1);
+  }
+
+  void TConcurrentChannel::wakeUpWaiters(eEventType evt, int n) {
+    assert(evt == EVT_CONCURRENT_CAN_PULL || evt == EVT_CONCURRENT_CAN_PUSH);
+    TList& waiters = (evt == EVT_CONCURRENT_CAN_PULL) ? waiting_for_pull : waiting_for_push;
+    internal::TScopedLock lock;
+    // The waiters unregister themselves when they leave the wait
+    while (n-- > 0) {
+      auto we = waiters.detachFirst< TWatchedEvent >();
+      if (!we)
+        break;
+      assert(we->concurrent.channel == this);
+      wakeUp(we);
+    }
+  }
+
+  void TConcurrentChannel::close() {
+    is_closed.store(true);
+    if (internal::isForeignThread()) {
+      internal::postChannelWake(this, EVT_CONCURRENT_CAN_PUSH, INT_MAX);
+      internal::postChannelWake(this, EVT_CONCURRENT_CAN_PULL, INT_MAX);
+      return;
+    }
+    wakeUpWaiters(EVT_CONCURRENT_CAN_PUSH, INT_MAX);
+    wakeUpWaiters(EVT_CONCURRENT_CAN_PULL, INT_MAX);
+  }
+
+}
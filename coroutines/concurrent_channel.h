@@ -0,0 +1,108 @@
+#ifndef INC_COROUTINES_CONCURRENT_CHANNEL_H_
+#define INC_COROUTINES_CONCURRENT_CHANNEL_H_
+
+#include <atomic>
+#include <thread>          // std::this_thread::yield
+#include "list.h"
+#include "coroutines.h"
+
+namespace Coroutines {
+
+  // ----------------------------------------
+  // A channel which can be used from any thread, including threads which
+  // are not running coroutines. Items go through a bounded lock-free ring,
+  // one sequence number per slot, so push and pull don't take any lock while
+  // the channel is neither full nor empty. The scheduler lock is only taken
+  // to park or wake up coroutines waiting for the channel.
+  // With runWorkers, other threads wake up the coroutines waiting for it
+  // themselves. With run or executeActives, they post the wakes to the
+  // scheduler thread, see internal::isForeignThread, and run() doesn't
+  // return while coroutines are waiting for a concurrent channel.
+  class TConcurrentChannel {
+    static const size_t cache_line_size = 64;
+
+    size_t                   bytes_per_elem;
+    size_t                   max_elems;       // Power of two
+    size_t                   mask;
+    std::atomic<size_t>*     seqs;            // Per slot
+    u8*                      data;
+    std::atomic<bool>        is_closed;
+
+    alignas(cache_line_size) std::atomic<size_t> push_pos;
+    alignas(cache_line_size) std::atomic<size_t> pull_pos;
+
+    u8* addrOfItem(size_t idx) {
+      assert(data);
+      assert(idx < max_elems);
+      return data + idx * bytes_per_elem;
+    }
+
+    void wakeUpOne(TList& waiters);
+
+  public:
+    // Modified with the scheduler lock. The counters let push and pull
+    // skip the lock when nobody is waiting
+    TList            waiting_for_push;
+    TList            waiting_for_pull;
+    std::atomic<int> npush_waiters;
+    std::atomic<int> npull_waiters;
+
+  public:
+    // new_max_elems is rounded up to a power of two
+    TConcurrentChannel(size_t new_max_elems, size_t new_bytes_per_elem);
+    ~TConcurrentChannel();
+    TConcurrentChannel(const TConcurrentChannel&) = delete;
+    TConcurrentChannel& operator=(const TConcurrentChannel&) = delete;
+
+    // Return false if the channel is full/empty, or closed when pushing
+    bool tryPush(const void* user_data, size_t user_data_size);
+    bool tryPull(void* user_data, size_t user_data_size);
+    bool closed() const { return is_closed.load(); }
+    // Both are just a hint when other threads are using the channel
+    bool empty() const;
+    bool full() const;
+    void close();
+    size_t bytesPerElem() const { return bytes_per_elem; }
+    // Up to n of the coroutines waiting for evt, with the scheduler lock
+    void wakeUpWaiters(eEventType evt, int n);
+  };
+
+  // -----------------------------------------------------
+  // Coroutines wait for the channel. Other threads just yield the cpu
+  template< typename TObj >
+  bool pull(TConcurrentChannel* ch, TObj& obj) {
+    assert(ch);
+    assert(&obj);
+    while (!ch->tryPull(&obj, sizeof(obj))) {
+      if (ch->closed() && ch->empty())
+        return false;
+      if (internal::inCoroutine()) {
+        TWatchedEvent evt(ch, obj, EVT_CONCURRENT_CAN_PULL);
+        wait(&evt, 1);
+      }
+      else
+        std::this_thread::yield();
+    }
+    return true;
+  }
+
+  template< typename TObj >
+  bool push(TConcurrentChannel* ch, const TObj& obj) {
+    assert(ch);
+    assert(&obj);
+    while (!ch->tryPush(&obj, sizeof(obj))) {
+      if (ch->closed())
+        return false;
+      if (internal::inCoroutine()) {
+        TWatchedEvent evt(ch, obj, EVT_CONCURRENT_CAN_PUSH);
+        wait(&evt, 1);
+      }
+      else
+        std::this_thread::yield();
+    }
+    return true;
+  }
+
+}
+
+#endif
@@ -1,20 +1,29 @@
 #include "coroutines.h"
 #include "channel.h"
+#include "concurrent_channel.h"
+#include "event.h"
 #include "timeline.h"
 #define NOMINMAX
 #include "api/coro_platform.h"   
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 
 namespace Coroutines {
 
   namespace internal {
 
-    THandle h_current;
     THandle h_main;
 
-    static const uint16_t INVALID_ID = 0xffff;
+    static const uint32_t INVALID_ID = 0xffffffff;
 
-    struct TCoro : public TCoroPlatform {
+    struct TCoro : public TCoroPlatform, public TListItem {   // TListItem links us in the ready queue
 
       enum eState {
         UNINITIALIZED
@@ -26,26 +35,161 @@ namespace Coroutines {
 
       eState                    state;
       THandle                   this_handle;
-      TWaitConditionFn          must_wait;
+      bool                    (*must_wait)(void*);  // While WAITING, in the polling list
+      void*                     must_wait_context;
+      TTimeStamp                next_poll;
+      TTimeDelta                poll_interval;
       TWatchedEvent*            event_waking_me_up; // Which event took us from the WAITING_FOR_EVENT
-      uint16_t                  prev_id;            // Only used when active
-      uint16_t                  next_id;
+      uint32_t                  next_id;            // In the free list
+      uint32_t                  last_pass;          // Last executeActives pass in which we run
+      int                       lock_depth;         // Scheduler lock taken when we switched out
+      void*                     future;             // TFuture receiving our result, see async
+      void*                     closure_on_heap;    // When it does not fit in closure
+      void                    (*resume_fn)(void*);  // Only the stackless ones, see startStackless
+      void*                     resume_context;
+      const char*               site;               // See TStartOptions
+      alignas(closure_inline_align) u8 closure[closure_inline_size];
       TList                     waiting_for_me;
 
-      TCoro() : state(UNINITIALIZED), event_waking_me_up(nullptr), prev_id(INVALID_ID), next_id(0) { }
+      TCoro() : state(UNINITIALIZED), must_wait(nullptr), must_wait_context(nullptr), event_waking_me_up(nullptr), next_id(INVALID_ID), last_pass(0), lock_depth(0), future(nullptr), closure_on_heap(nullptr), resume_fn(nullptr), resume_context(nullptr), site(nullptr) { }
     };
 
-    std::vector< TCoro > coros;
-    uint16_t             first_free = 0;
-    uint16_t             last_free = 0;
-    uint16_t             first_in_use = INVALID_ID;
-    uint16_t             last_in_use = INVALID_ID;
+    // Coros live in chunks that are never moved or released, so the
+    // address of a TCoro is valid as long as the system is initialized
+    static const uint32_t coros_per_chunk = 256;
+    static const uint32_t max_coros = 1 << 22;
+    static const uint32_t max_chunks = (max_coros + coros_per_chunk - 1) / coros_per_chunk;
+
+    // Workers can read the table while another one is adding a chunk
+    TCoro*                chunks[max_chunks];
+    std::atomic<uint32_t> ncoros(0);
+    uint32_t              first_free = INVALID_ID;     // Free slots are recycled in FIFO order
+    uint32_t              last_free = INVALID_ID;
+
+    // Each thread running coroutines. Coroutines yield to the co_sched of the
+    // thread where they are running, which might not be the one where they
+    // started.
+    struct TWorker {
+      int            id;
+      TCoroPlatform* co_sched;
+      THandle        h_current;
+      TCoro*         co_running;
+      // Coroutines that can run, in FIFO order. Neither the running one nor 
+      // the ones waiting for events are here. Other workers steal from it
+      TList          ready;
+      std::mutex     ready_mutex;
+      // Ready coroutines which are still running in this thread. They are moved
+      // to the ready list once we are out of them, so nobody resumes them before
+      TList          parked;
+      // The last coroutine made ready by the running one, and how many, for
+      // the direct handoff, and the handoffs since the scheduler run one
+      TCoro*         last_woken;
+      uint32_t       nwoken;
+      uint32_t       nhandoffs;
+      TWorker() : id(0), co_sched(nullptr), co_running(nullptr), last_woken(nullptr), nwoken(0), nhandoffs(0) { }
+    };
+
+    TWorker               main_worker;
+    std::vector<TWorker*> workers;                       // Only while runWorkers
+    uint32_t              current_pass = 0;              // Each executeActives is a new pass
+    std::atomic<int>      nactive_coros(0);              // Started and not finished, main not included
+    uint32_t              handoff_limit = 0;             // See setHandOffLimit
+
+    // See setStackTracking. Few sites, so they are just searched
+    bool                      track_stacks = false;
+    TStackUsedFn              on_stack_used = nullptr;
+    std::vector<TStackUsage>  stack_sites;
+    static const unsigned     default_stack_size = 128 * 1024;
+
+    // Coroutines in wait(TWaitConditionFn), not in any ready list. The scheduler
+    // evaluates their conditions. next_poll_time is the earliest of them
+    TList                 polling;
+    TTimeStamp            next_poll_time = 0;
+
+    // With several workers, the coroutines table, the event lists, the channels
+    // and the timers are protected by a single lock. A coroutine switching out
+    // with the lock taken keeps it until it's out of its stack, and takes it 
+    // again before being resumed, maybe in another thread.
+    bool                  multithreaded = false;
+    std::mutex            sched_mutex;
+    std::mutex            idle_mutex;
+    std::condition_variable idle_cv;
+    std::atomic<int>      nidle_workers(0);
+
+    // Wakes of concurrent channels posted by foreign threads, see isForeignThread.
+    // While coroutines wait for concurrent channels, run() waits for them
+    struct TChannelWake {
+      TConcurrentChannel* channel;
+      eEventType          event_type;
+      int                 n;
+    };
+    std::mutex                foreign_mutex;
+    std::condition_variable   foreign_cv;
+    std::vector<TChannelWake> foreign_wakes;
+    std::atomic<bool>         foreign_wakes_posted(false);
+    std::atomic<int>          nconcurrent_waiters(0);
+
+    thread_local TWorker* worker = nullptr;
+    thread_local int      lock_depth = 0;
+
+    // Coroutines can resume in another thread, and the compiler might keep the
+    // address of a thread_local across the switch, so we read them out of line
+    CORO_NOINLINE TWorker* thisWorker() {
+      return worker;
+    }
+
+    CORO_NOINLINE int lockDepth() {
+      return lock_depth;
+    }
+
+    CORO_NOINLINE void setLockDepth(int new_depth) {
+      lock_depth = new_depth;
+    }
+
+    // ----------------------------------------------------------
+    // The depth is tracked also with a single thread, so coroutines waiting 
+    // before runWorkers hold it when they are resumed by a worker
+    void lock() {
+      int depth = lockDepth();
+      setLockDepth(depth + 1);
+      if (depth == 0 && multithreaded)
+        sched_mutex.lock();
+    }
+
+    void unlock() {
+      int depth = lockDepth() - 1;
+      setLockDepth(depth);
+      if (depth == 0 && multithreaded)
+        sched_mutex.unlock();
+    }
+
+    // The coroutine is about to switch out with the lock taken
+    void saveLock(TCoro* co) {
+      co->lock_depth = lockDepth();
+      setLockDepth(0);
+      if (co->lock_depth && multithreaded)
+        sched_mutex.unlock();
+    }
+
+    void restoreLock(TCoro* co) {
+      if (!co->lock_depth)
+        return;
+      if (multithreaded)
+        sched_mutex.lock();
+      setLockDepth(co->lock_depth);
+      co->lock_depth = 0;
+    }
+
+    TCoro* byId(uint32_t id) {
+      assert(id < ncoros.load(std::memory_order_acquire));
+      return &chunks[id / coros_per_chunk][id % coros_per_chunk];
+    }
 
     // ----------------------------------------------------------
     TCoro* byHandle(THandle h) {
-      if (h.id >= coros.size())
+      if (h.id >= ncoros.load(std::memory_order_acquire))
         return nullptr;
-      TCoro* c = &coros[h.id];
+      TCoro* c = byId(h.id);
       assert(c->this_handle.id == h.id);
       if (h.age != c->this_handle.age)
         return nullptr;
@@ -54,107 +198,329 @@ namespace Coroutines {
 
     // ----------------------------------------------------------
     void dump(const char* title) {
-      printf("Dump FirstFree: %d LastFree:%d FirstInUse:%d - LastInUse:%d %s\n", first_free, last_free, first_in_use, last_in_use, title);
-      int idx = 0;
-      for (auto& co : coros) {
-        printf("%04x : prev:%04x next:%04x state:%d\n", idx, co.prev_id, co.next_id, co.state);
-        ++idx;
+      uint32_t n = ncoros;
+      printf("Dump FirstFree: %d LastFree:%d NCoros:%d Pass:%d %s\n", first_free, last_free, n, current_pass, title);
+      for (uint32_t idx = 0; idx < n; ++idx) {
+        auto co = byId(idx);
+        printf("%04x : next:%04x state:%d\n", idx, co->next_id, co->state);
       }
     }
 
+    // ----------------------------------------------------------
+    void appendToFreeList(TCoro* co) {
+      uint32_t id = co->this_handle.id;
+      co->next_id = INVALID_ID;
+      if (last_free != INVALID_ID)
+        byId(last_free)->next_id = id;
+      else
+        first_free = id;
+      last_free = id;
+    }
+
+    // ----------------------------------------------------------
+    bool addChunk() {
+      uint32_t nold = ncoros;
+      if (nold >= max_coros)
+        return false;
+      auto chunk = new TCoro[coros_per_chunk];
+      chunks[nold / coros_per_chunk] = chunk;
+      uint32_t n = coros_per_chunk;
+      if (nold + n > max_coros)
+        n = max_coros - nold;
+      for (uint32_t i = 0; i < n; ++i) {
+        auto& co = chunk[i];
+        co.this_handle.id = nold + i;
+        co.this_handle.age = 1;
+      }
+      ncoros.store(nold + n, std::memory_order_release);
+      for (uint32_t i = 0; i < n; ++i)
+        appendToFreeList(&chunk[i]);
+      return true;
+    }
+
     // ----------------------------------------------------------
     TCoro* findFree() {
+      if (first_free == INVALID_ID && !addChunk())
+        return nullptr;
 
-      for (auto& co : coros) {
-        if (co.state != TCoro::FREE && co.state != TCoro::UNINITIALIZED)
-          continue;
-        co.state = TCoro::RUNNING;
-        return &co;
+      auto co = byId(first_free);
+      assert(co->state == TCoro::FREE || co->state == TCoro::UNINITIALIZED);
+      first_free = co->next_id;
+      if (first_free == INVALID_ID)
+        last_free = INVALID_ID;
+      co->next_id = INVALID_ID;
+      co->state = TCoro::RUNNING;
+      co->lock_depth = 0;
+      co->future = nullptr;
+      co->resume_fn = nullptr;
+      return co;
+    }
+
+    // ----------------------------------------------------------
+    void pushReady(TCoro* co) {
+      assert(co->state == TCoro::RUNNING);
+      assert(!co->isMain());
+      auto w = thisWorker();
+      if (!multithreaded) {
+        assert(w);
+        w->ready.append(co);
+        if (w->co_running && co != w->co_running) {
+          w->last_woken = co;
+          ++w->nwoken;
+        }
+        return;
+      }
+      if (w && co == w->co_running) {
+        w->parked.append(co);
+        return;
+      }
+      // Woken up from a thread which is not a worker
+      if (!w)
+        w = workers[0];
+      {
+        std::lock_guard<std::mutex> guard(w->ready_mutex);
+        w->ready.append(co);
       }
+      if (nidle_workers > 0)
+        idle_cv.notify_one();
+    }
 
-      return nullptr;
+    // ----------------------------------------------------------
+    bool concurrentEventReady(const TWatchedEvent* we) {
+      auto ch = we->concurrent.channel;
+      if (we->event_type == EVT_CONCURRENT_CAN_PULL)
+        return !ch->empty() || ch->closed();
+      if (we->event_type == EVT_CONCURRENT_CAN_PUSH)
+        return !ch->full() || ch->closed();
+      return false;
+    }
+
+    bool ioEventFailed(const TWatchedEvent* we) {
+      return (we->event_type == EVT_IO_READABLE || we->event_type == EVT_IO_WRITABLE) && we->io.error;
+    }
+
+    // ----------------------------------------------------------
+    // Back in the scheduler from the last coroutine run in this thread. If it
+    // left with the lock, it's out of its stack now, so it can be released
+    void switchedBack(TWorker* w) {
+      TCoro* co_last = w->co_running;
+      if (co_last && co_last->state != TCoro::FREE)
+        saveLock(co_last);
+      else if (lockDepth()) {
+        setLockDepth(0);
+        if (multithreaded)
+          sched_mutex.unlock();
+      }
+      w->h_current = h_main;
+      w->co_running = nullptr;
+    }
+
+    // Moves the coroutines whose condition no longer holds to the ready list
+    void pollConditions() {
+      TScopedLock lock;
+      if (polling.empty())
+        return;
+      TTimeStamp t = now();
+      TTimeStamp earliest = ~((TTimeStamp)0);
+      TListItem* item = polling.first;
+      while (item) {
+        auto co = static_cast<TCoro*>(item);
+        item = item->next;
+        assert(co->state == TCoro::WAITING);
+        if (co->next_poll <= t) {
+          if (!co->must_wait(co->must_wait_context)) {
+            polling.detach(co);
+            co->state = TCoro::RUNNING;
+            pushReady(co);
+            continue;
+          }
+          co->next_poll = t + co->poll_interval;
+        }
+        if (co->next_poll < earliest)
+          earliest = co->next_poll;
+      }
+      next_poll_time = earliest;
+    }
+
+    // With the mutex taken, so the channels can't be destroyed meanwhile
+    void runForeignWakes() {
+      if (!foreign_wakes_posted)
+        return;
+      TScopedLock lock;
+      std::lock_guard<std::mutex> guard(foreign_mutex);
+      for (auto& wake : foreign_wakes)
+        wake.channel->wakeUpWaiters(wake.event_type, wake.n);
+      foreign_wakes.clear();
+      foreign_wakes_posted = false;
+    }
 
-      /*
-      //dump("findfree");
-      // Find a free slot
-      int idx = first_free;
-      assert(idx != INVALID_ID);
-
-      auto& co = coros[idx];
-      assert(co.state == TCoro::FREE || co.state == TCoro::UNINITIALIZED);
-      assert(co.this_handle.id == idx);
-      co.state = TCoro::RUNNING;
-
-      // Update the next id to the next in the chain
-      first_free = co.next_id;
-
-      // I become the last in the active list... 
-      if (last_in_use != INVALID_ID)
-        coros[last_in_use].next_id = idx;
-      // Maybe I'm the first in the chain of actives
-      if (first_in_use == INVALID_ID)
-        first_in_use = idx;
-      co.prev_id = last_in_use;
-      // I'm the last of the active list
-      co.next_id = INVALID_ID;
-      last_in_use = idx;
-      if (first_free != INVALID_ID)
-        coros[first_free].prev_id = INVALID_ID;
-
-      return &co;
-      */
+    // Blocks the single thread scheduler until a wake is posted
+    void waitForeignWakes(TTimeDelta max_wait) {
+      std::unique_lock<std::mutex> guard(foreign_mutex);
+      auto posted = []() { return !foreign_wakes.empty(); };
+      if (max_wait == no_timeout)
+        foreign_cv.wait(guard, posted);
+      else
+        foreign_cv.wait_for(guard, std::chrono::nanoseconds(max_wait), posted);
+    }
+
+    bool nextPoll(TTimeStamp& when) {
+      if (polling.empty())
+        return false;
+      when = next_poll_time;
+      return true;
+    }
+
+    bool nextPollAfter(TTimeStamp t, TTimeStamp& when) {
+      bool found = false;
+      for (TListItem* item = polling.first; item; item = item->next) {
+        auto co = static_cast<TCoro*>(item);
+        if (co->next_poll > t && (!found || co->next_poll < when)) {
+          when = co->next_poll;
+          found = true;
+        }
+      }
+      return found;
+    }
+
+    // When the next timeout fires, or a condition must be evaluated. The
+    // virtual clock jumps there, so the conditions already due, which have
+    // just been evaluated and keep waiting, don't count. With a poll interval
+    // of 0 they are due all the time, and the clock would never move
+    bool nextDeadline(TTimeStamp& when) {
+      TScopedLock lock;
+      bool found = nextTimeout(when);
+      TTimeStamp poll_when = 0;
+      bool has_poll = (clockMode() == CLOCK_MODE_VIRTUAL) ? nextPollAfter(now(), poll_when) : nextPoll(poll_when);
+      if (has_poll && (!found || poll_when < when)) {
+        when = poll_when;
+        found = true;
+      }
+      return found;
+    }
+
+    // ----------------------------------------------------------
+    // The only coroutine woken up by the running one, taken out of the ready
+    // list, if it can run now without starving the others
+    TCoro* handOffTarget(TWorker* w) {
+      if (multithreaded || w->nwoken != 1 || w->nhandoffs >= handoff_limit)
+        return nullptr;
+      auto co = w->last_woken;
+      assert(co && co->state == TCoro::RUNNING);
+      // Stackless ones can only be resumed from the scheduler
+      if (co->resume_fn)
+        return nullptr;
+      w->ready.detach(co);
+      co->last_pass = current_pass;
+      ++w->nhandoffs;
+      return co;
+    }
+
+    // ----------------------------------------------------------
+    // Sites are usually string literals or type names, so the same pointer
+    void trackStack(TCoro* co) {
+      unsigned used = co->stackUsed();
+      TStackUsage* usage = nullptr;
+      for (auto& s : stack_sites) {
+        if (s.site == co->site || strcmp(s.site, co->site) == 0) {
+          usage = &s;
+          break;
+        }
+      }
+      if (!usage) {
+        stack_sites.push_back(TStackUsage{ co->site, 0, 0, 0, 0 });
+        usage = &stack_sites.back();
+      }
+      ++usage->ncoroutines;
+      usage->total_used += used;
+      if (used > usage->max_used)
+        usage->max_used = used;
+      usage->stack_size = co->stackSize();
+      if (on_stack_used)
+        on_stack_used(co->this_handle, co->site, used, co->stackSize());
     }
 
     // --------------------------
-    THandle prologue(void(*boot_fn)(void*), void* context) {
+    THandle prologue(void(*boot_fn)(void*), void (*move_closure)(void* dst, void* src), void* src, size_t size, size_t align, const TStartOptions& options, const char* default_site) {
 
+      lock();
       auto* co_new = findFree();
-      assert(co_new);                               // Run out of free coroutines slots
+      assert(co_new);                               // Run out of coroutines ids
+      if (!co_new) {
+        unlock();
+        return THandle();
+      }
       assert(co_new->state == TCoro::RUNNING);
 
+      // Out of memory, or of vm.max_map_count for the guard pages
+      co_new->setStackSize(options.stack_size ? options.stack_size : default_stack_size);
+      if (!co_new->allocStack()) {
+        co_new->state = TCoro::FREE;
+        appendToFreeList(co_new);
+        unlock();
+        return THandle();
+      }
+
+      void* context = co_new->closure;
+      if (size > closure_inline_size || align > closure_inline_align) {
+        // operator new only aligns to max_align_t, beyond that we align it
+        // ourselves. closure_on_heap keeps what has to be deleted
+        size_t extra = (align > alignof(std::max_align_t)) ? align - 1 : 0;
+        co_new->closure_on_heap = ::operator new(size + extra);
+        context = (void*)(((uintptr_t)co_new->closure_on_heap + extra) & ~(uintptr_t)(align - 1));
+      }
+      move_closure(context, src);
+      co_new->site = options.site ? options.site : default_site;
+
       auto co_curr = byHandle(current());
       assert(co_curr);
 
-      THandle h_prev_current = h_current;
-      h_current = co_new->this_handle;
+      // The new co will return control to the scheduler, not to us, so we
+      // must be resumed from the ready queue like after a yield. Unless we
+      // are main or a stackless one, running in the stack it returns to
+      bool in_sched_stack = co_curr->isMain() || co_curr->resume_fn;
+      if (!in_sched_stack)
+        pushReady(co_curr);
+      ++nactive_coros;
+
+      THandle h_new = co_new->this_handle;
+      auto w = thisWorker();
+      THandle h_prev_current = w->h_current;
+      TCoro* co_prev_running = w->co_running;
+      w->h_current = h_new;
+      w->co_running = co_new;
+      w->nwoken = 0;
+      // Nobody can resume us until the new co has switched out, and then
+      // we take the lock again
+      saveLock(co_curr);
       co_new->start(boot_fn, context);
-      h_current = h_prev_current;
-      return co_new->this_handle;
+      if (in_sched_stack) {
+        switchedBack(w);
+        restoreLock(co_curr);
+        w->co_running = co_prev_running;
+      }
+      thisWorker()->h_current = h_prev_current;
+      unlock();
+      return h_new;
     }
 
     // ----------------------------------
-    // Executed after running the user defined function
-    void epilogue() {
-      auto co_curr = byHandle(h_current);
-      assert(co_curr);
-      auto co_main = byHandle(h_main);
-      assert(co_main);
-
-      //dump("about to exit");
-
+    // The coroutine has finished. Its slot is recycled, and those waiting
+    // for it are woken up
+    void finish(TCoro* co_curr) {
       // Add myself to the list of coro's to be recycled...
       co_curr->state = TCoro::FREE;
       co_curr->this_handle.age++;
+      if (--nactive_coros == 0 && multithreaded)
+        idle_cv.notify_all();
 
-      uint16_t my_id = co_curr->this_handle.id;
+      appendToFreeList(co_curr);
 
-      // Remove me from the chain of actives
-      if (co_curr->prev_id != INVALID_ID)
-        coros[co_curr->prev_id].next_id = co_curr->next_id;
-      if (co_curr->next_id != INVALID_ID)
-        coros[co_curr->next_id].prev_id = co_curr->prev_id;
-      if (my_id == first_in_use)
-        first_in_use = co_curr->next_id;
-
-      if (my_id == last_in_use)
-        last_in_use = co_curr->prev_id;
-
-      // This becomes the last free
-      co_curr->prev_id = last_free;
-      co_curr->next_id = INVALID_ID;
-      if (last_free != INVALID_ID)
-        coros[last_free].next_id = my_id;
-      last_free = my_id;
+      // The closure has already been destroyed by bootstrap
+      if (co_curr->closure_on_heap) {
+        ::operator delete(co_curr->closure_on_heap);
+        co_curr->closure_on_heap = nullptr;
+      }
 
       // Wake up those coroutines that were waiting for me to finish
       while (true) {
@@ -163,11 +529,172 @@ namespace Coroutines {
           break;
         wakeUp(we);
       }
+    }
+
+    // Executed after running the user defined function
+    void epilogue() {
+      lock();
+      auto w = thisWorker();
+      auto co_curr = byHandle(w->h_current);
+      assert(co_curr);
+
+      // Still in our stack
+      if (track_stacks)
+        trackStack(co_curr);
+      finish(co_curr);
+
+      // Return to the scheduler. Our stack goes back to the pool, and
+      // the scheduler releases the lock once we are out of it
+      co_curr->exitTo(w->co_sched);
+    }
+
+    // ----------------------------------------------------------
+    // Moves the coroutines parked while running to the ready list
+    void flushParked(TWorker* w) {
+      if (w->parked.empty())
+        return;
+      {
+        std::lock_guard<std::mutex> guard(w->ready_mutex);
+        while (auto co = w->parked.detachFirst< TCoro >())
+          w->ready.append(co);
+      }
+      if (nidle_workers > 0)
+        idle_cv.notify_one();
+    }
+
+    // ----------------------------------------------------------
+    TCoro* popReady(TWorker* w) {
+      std::lock_guard<std::mutex> guard(w->ready_mutex);
+      return w->ready.detachFirst< TCoro >();
+    }
+
+    // Take the oldest ready coroutine of another worker
+    TCoro* steal(TWorker* w) {
+      int n = (int)workers.size();
+      for (int i = 1; i < n; ++i) {
+        auto victim = workers[(w->id + i) % n];
+        std::unique_lock<std::mutex> guard(victim->ready_mutex, std::try_to_lock);
+        if (!guard.owns_lock())
+          continue;
+        if (auto co = victim->ready.detachFirst< TCoro >())
+          return co;
+      }
+      return nullptr;
+    }
+
+    // ----------------------------------------------------------
+    // From the scheduler. The stackless ones run right here, in its stack
+    void resumeCoroutine(TWorker* w, TCoro* co) {
+      if (co->resume_fn)
+        co->resume_fn(co->resume_context);
+      else
+        w->co_sched->switchTo(co);
+    }
+
+    // ----------------------------------------------------------
+    void runCoroutine(TWorker* w, TCoro* co) {
+      assert(co->state == TCoro::RUNNING);
+      restoreLock(co);
+      w->h_current = co->this_handle;
+      w->co_running = co;
+      resumeCoroutine(w, co);
+      switchedBack(w);
+      flushParked(w);
+    }
+
+    // ----------------------------------------------------------
+    // Sleeping in idle, and nothing left for them to run
+    bool othersIdle(TWorker* w) {
+      if (nidle_workers != (int)workers.size() - 1)
+        return false;
+      for (auto other : workers) {
+        if (other == w)
+          continue;
+        std::lock_guard<std::mutex> guard(other->ready_mutex);
+        if (!other->ready.empty())
+          return false;
+      }
+      return true;
+    }
+
+    // ----------------------------------------------------------
+    void idle(TWorker* w) {
+      std::chrono::nanoseconds max_sleep = std::chrono::milliseconds(1);
+
+      // The first worker drives the timers and the conditions. Don't sleep
+      // past the next one...
+      if (w->id == 0) {
+        pollConditions();
+        std::lock_guard<std::mutex> guard(w->ready_mutex);
+        if (!w->ready.empty())
+          return;
+      }
+      // ...and with the virtual clock, once all the workers are idle, it
+      // jumps to the next deadline, like run()
+      if (w->id == 0 && clockMode() == CLOCK_MODE_VIRTUAL && othersIdle(w)) {
+        TTimeStamp when;
+        if (nextDeadline(when)) {
+          TScopedLock lock;
+          updateCurrentTime(when > now() ? when - now() : 0);
+          return;
+        }
+      }
+      if (w->id == 0 && clockMode() == CLOCK_MODE_MONOTONIC) {
+        lock();
+        TTimeStamp when;
+        if (nextTimeout(when)) {
+          TTimeDelta delta = when > now() ? when - now() : 0;
+          if (delta < (TTimeDelta)max_sleep.count())
+            max_sleep = std::chrono::nanoseconds(delta);
+        }
+        if (nextPoll(when)) {
+          TTimeDelta delta = when > now() ? when - now() : 0;
+          if (delta < (TTimeDelta)max_sleep.count())
+            max_sleep = std::chrono::nanoseconds(delta);
+        }
+        unlock();
+      }
 
-      //dump("after exit");
+      // And the fds. Any coroutine woken up by another worker will wait a bit
+      if (w->id == 0 && ioEventsPending()) {
+        pollIO(max_sleep.count());
+        return;
+      }
+
+      std::unique_lock<std::mutex> guard(idle_mutex);
+      if (nactive_coros == 0)
+        return;
+      ++nidle_workers;
+      idle_cv.wait_for(guard, max_sleep);
+      --nidle_workers;
+    }
 
-      // Return to main coroutine
-      co_curr->switchTo(co_main);
+    // ----------------------------------------------------------
+    void workerLoop(TWorker* w) {
+      // Polling the fds is a syscall, so the first worker doesn't do it
+      // for every coroutine it runs
+      const uint32_t io_poll_period = 64;
+      uint32_t niters = 0;
+      while (nactive_coros > 0) {
+        if (w->id == 0) {
+          lock();
+          updateCurrentTime(1);
+          unlock();
+          if (++niters % io_poll_period == 0) {
+            pollIO(0);
+            pollConditions();
+            // Posted before runWorkers
+            runForeignWakes();
+          }
+        }
+        TCoro* co = popReady(w);
+        if (!co)
+          co = steal(w);
+        if (co)
+          runCoroutine(w, co);
+        else
+          idle(w);
+      }
     }
 
   }
@@ -177,131 +704,280 @@ namespace Coroutines {
     return internal::byHandle(h) != nullptr;
   }
 
+  // --------------------------
+  void internal::setFuture(THandle h, void* future) {
+    TScopedLock lock;
+    auto co = byHandle(h);
+    if (co)
+      co->future = future;
+  }
+
+  void* internal::currentFuture() {
+    TScopedLock lock;
+    auto co = byHandle(current());
+    assert(co);
+    return co->future;
+  }
+
+  // --------------------------
+  bool internal::inCoroutine() {
+    auto co = internal::byHandle(current());
+    return co && !co->isMain();
+  }
+
+  // --------------------------
+  bool internal::isForeignThread() {
+    return !multithreaded && !thisWorker();
+  }
+
+  void internal::postChannelWake(TConcurrentChannel* ch, eEventType evt, int n) {
+    {
+      std::lock_guard<std::mutex> guard(foreign_mutex);
+      bool merged = false;
+      for (auto& wake : foreign_wakes) {
+        if (wake.channel == ch && wake.event_type == evt) {
+          wake.n = (n > INT_MAX - wake.n) ? INT_MAX : wake.n + n;
+          merged = true;
+          break;
+        }
+      }
+      if (!merged)
+        foreign_wakes.push_back(TChannelWake{ ch, evt, n });
+      foreign_wakes_posted = true;
+    }
+    // The scheduler might be sleeping in any of them
+    foreign_cv.notify_one();
+    interruptPollIO();
+  }
+
+  void internal::cancelChannelWakes(TConcurrentChannel* ch) {
+    std::lock_guard<std::mutex> guard(foreign_mutex);
+    size_t n = 0;
+    for (auto& wake : foreign_wakes) {
+      if (wake.channel != ch)
+        foreign_wakes[n++] = wake;
+    }
+    foreign_wakes.resize(n);
+  }
+
   // --------------------------
   THandle current() {
-    return internal::h_current;
+    auto w = internal::thisWorker();
+    return w ? w->h_current : THandle();
   }
 
   // --------------------------
   void yield() {
-    auto co_curr = internal::byHandle(current());
+    auto w = internal::thisWorker();
+    auto co_curr = internal::byHandle(w->h_current);
     assert(co_curr);
 
-    auto co_main = internal::byHandle(internal::h_main);
-    assert(co_main);
-
     // You can't yield with the main co, or we will not be able
     // to activate other co's to unlock us
-    assert(co_curr != co_main);
+    assert(!co_curr->isMain());
+    // The stackless ones suspend with co_await, see task.h
+    assert(!co_curr->resume_fn);
+
+    // Waiting for events or for a condition, someone will wakeUp us
+    if (co_curr->state == internal::TCoro::RUNNING)
+      internal::pushReady(co_curr);
+    else if (auto co_next = internal::handOffTarget(w)) {
+      switchTo(co_next->this_handle);
+      return;
+    }
 
-    // Return control to main co
-    co_curr->switchTo(co_main);
+    // Return control to the scheduler of this thread
+    co_curr->switchTo(w->co_sched);
   }
 
   // --------------------------
-  void wait(TWaitConditionFn fn) {
+  // The condition is not copied, it stays in our stack while we wait
+  void wait(TWaitConditionFn fn, TTimeDelta poll_interval) {
+    internal::waitWhile(&internal::callPredicate<TWaitConditionFn>, &fn, poll_interval);
+  }
+
+  void internal::waitWhile(bool (*must_wait)(void*), void* context, TTimeDelta poll_interval) {
     // If the condition does not apply now, don't wait
-    if (!fn())
+    if (!must_wait(context))
       return;
-    auto co = internal::byHandle(current());
-    assert(co);
-    co->state = internal::TCoro::WAITING;
-    co->must_wait = fn;
+    // Kept while we sleep, see internal::lock
+    TScopedLock lock;
+    auto co = byHandle(current());
+    assert(co && !co->isMain());
+    co->must_wait = must_wait;
+    co->must_wait_context = context;
+    co->poll_interval = poll_interval;
+    co->next_poll = now() + poll_interval;
+    if (polling.empty() || co->next_poll < next_poll_time)
+      next_poll_time = co->next_poll;
+    polling.append(co);
+    co->state = TCoro::WAITING;
     yield();
+    assert(co->state == TCoro::RUNNING);
+    co->must_wait = nullptr;
+    co->must_wait_context = nullptr;
   }
 
   // ----------------------------------------------------------
   int executeActives() {
     using namespace internal;
-
-    auto co_main = byHandle(h_main);
-    assert(co_main);
-
-    int nactives = 0;
-    for (auto& co : coros) {
-      if (co.isMain())
-        continue;
-      if (co.state == TCoro::FREE || co.state == TCoro::UNINITIALIZED)
+    assert(!multithreaded);
+
+    auto w = thisWorker();
+    TList& ready = w->ready;
+
+    int nactives = nactive_coros;
+    pollConditions();
+    runForeignWakes();
+
+    // Each coroutine runs at most once per pass. Those woken up by another
+    // in this pass still run in it, but those yielding run in the next one
+    ++current_pass;
+    TList next_pass;
+    while (auto co = ready.detachFirst< TCoro >()) {
+      assert(co->state == TCoro::RUNNING);
+      if (co->last_pass == current_pass) {
+        next_pass.append(co);
         continue;
-
-      ++nactives;
-      if (co.state == TCoro::WAITING_FOR_EVENT)
-        continue;
-
-      h_current = co.this_handle;
-      co_main->switchTo(&co);
-      h_current = h_main;
+      }
+      co->last_pass = current_pass;
+      restoreLock(co);
+      w->h_current = co->this_handle;
+      w->co_running = co;
+      w->nwoken = 0;
+      w->nhandoffs = 0;
+      resumeCoroutine(w, co);
+      switchedBack(w);
     }
-      /*
+    ready = next_pass;
 
-    auto co_main = byHandle(h_main);
-    assert(co_main);
-
-    int nactives = 0;
-    int idx = first_in_use;
-    while (idx != INVALID_ID) {
-      auto& co = coros[idx];
-      idx = co.next_id;
-      assert(co.state != TCoro::FREE);
-      if (co.is_main)
-        continue;
+    return nactives;
+  }
 
-      nactives++;
-      if (co.state == TCoro::WAITING_FOR_EVENT)
+  // ----------------------------------------------------------
+  void run() {
+    using namespace internal;
+    assert(current().id == h_main.id);
+
+    eClockMode mode = clockMode();
+    while (nactive_coros > 0) {
+      if (mode != CLOCK_MODE_VIRTUAL)
+        updateCurrentTime(1);
+      pollIO(0);
+      executeActives();
+      if (!thisWorker()->ready.empty() || mode == CLOCK_MODE_TICKS)
         continue;
-      if (co.state == TCoro::WAITING) {
-        if (co.must_wait())
+      // Before time jumps, the conditions see what the coroutines have just done
+      if (mode == CLOCK_MODE_VIRTUAL) {
+        pollConditions();
+        if (!thisWorker()->ready.empty())
           continue;
-        co.state = TCoro::RUNNING;
       }
-      assert(co.state == internal::TCoro::RUNNING);
 
-      // asumming we are in the main coroutine!
-      h_current = co.this_handle;
-      co_main->switchTo(&co);
-      h_current = THandle();
+      // Nothing to do until an fd is ready, the next timeout or the next
+      // time a condition must be evaluated
+      TTimeStamp when;
+      bool has_timeout = nextDeadline(when);
+      TTimeDelta max_wait = has_timeout ? (when > now() ? when - now() : 0) : io_no_timeout;
+      bool can_block = mode == CLOCK_MODE_MONOTONIC || !has_timeout;
+      // Other threads can still wake up those waiting for concurrent channels
+      bool other_threads = nconcurrent_waiters > 0;
+      if (other_threads && foreign_wakes_posted)
+        continue;
+      if (ioEventsPending() && can_block) {
+        // Without epoll, checking them from time to time
+        if (other_threads && !canInterruptPollIO() && max_wait > milliseconds(1))
+          max_wait = milliseconds(1);
+        pollIO(max_wait);
+        continue;
+      }
+      if (other_threads && can_block) {
+        waitForeignWakes(max_wait);
+        continue;
+      }
+      if (!has_timeout)
+        break;                // Nobody will wake up the coroutines left
+      if (mode == CLOCK_MODE_VIRTUAL)
+        updateCurrentTime(when - now());
+      else if (when > now())
+        sleepUntil(when);
     }
-    h_current = h_main;
-    */
-
-    return nactives;
   }
 
   // ----------------------------------------------------------
-  void initialize() {
+  void initialize(TCoroPlatform::eBackend backend) {
     using namespace internal;
 
-    coros.resize(8);
-    int idx = 0;
-    for (auto& co : coros) {
-      co.this_handle.id = idx;
-      co.this_handle.age = 1;
+    bool backend_is_available = TCoroPlatform::setBackend(backend);
+    assert(backend_is_available);
 
-      //if (idx > 0)
-      //  co.prev_id = idx - 1;
-      //else
-      //  co.prev_id = INVALID_ID;
-
-      //if (idx != coros.size() - 1)
-      //  co.next_id = idx + 1;
-      //else
-      //  co.next_id = INVALID_ID;
-
-      ++idx;
-    }
-    first_free = 0;
-    last_free = idx - 1;
-    //dump("OnBoot");
+    addChunk();
 
     auto co_main = findFree();
     assert(co_main);
     co_main->initAsMain();
     h_main = co_main->this_handle;
-    h_current = h_main;
+    main_worker.co_sched = co_main;
+    main_worker.h_current = h_main;
+    worker = &main_worker;
+  }
+
+  // ----------------------------------------------------------
+  void runWorkers(int nthreads) {
+    using namespace internal;
+    assert(thisWorker() == &main_worker);
+    assert(current().id == h_main.id);
+    assert(nthreads > 0);
+
+    // This thread is the first worker
+    workers.push_back(&main_worker);
+    for (int i = 1; i < nthreads; ++i) {
+      auto w = new TWorker;
+      w->id = i;
+      w->h_current = h_main;
+      workers.push_back(w);
+    }
+    // Whatever was ready before, runs first
+    multithreaded = true;
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nthreads; ++i) {
+      auto w = workers[i];
+      threads.emplace_back([w]() {
+        TCoroPlatform co_sched;
+        co_sched.initAsMain();
+        w->co_sched = &co_sched;
+        worker = w;
+        workerLoop(w);
+        worker = nullptr;
+      });
+    }
+    workerLoop(&main_worker);
+
+    for (auto& t : threads)
+      t.join();
+    multithreaded = false;
+    for (int i = 1; i < nthreads; ++i) {
+      assert(workers[i]->ready.empty());
+      delete workers[i];
+    }
+    workers.clear();
   }
 
   // --------------------------------------------------------------
   int wait(TWatchedEvent* watched_events, int nwatched_events, TTimeDelta timeout) {
+    // Kept while we sleep, see internal::lock
+    internal::TScopedLock lock;
+    TWatchedEvent time_we;
+    int idx = internal::beginWait(watched_events, nwatched_events, timeout, &time_we);
+    if (idx != internal::wait_must_suspend)
+      return idx;
+    yield();
+    return internal::endWait(watched_events, nwatched_events, timeout, &time_we);
+  }
+
+  // --------------------------------------------------------------
+  int internal::beginWait(TWatchedEvent* watched_events, int nwatched_events, TTimeDelta timeout, TWatchedEvent* time_we) {
     int n = nwatched_events;
     auto we = watched_events;
 
@@ -310,13 +986,18 @@ namespace Coroutines {
     int idx = 0;
     while (idx < n) {
 
+      we = watched_events + idx;
       switch(we->event_type) {
+      case EVT_USER_EVENT:
+        if (we->user.event->isSet())
+          return idx;
+        break;
       case EVT_CHANNEL_CAN_PULL:
-        if (!we->channel.channel->empty() || we->channel.channel->closed())
+        if (we->channel.channel->canPull() || (we->channel.channel->closed() && we->channel.channel->empty()))
           return idx;
         break;
       case EVT_CHANNEL_CAN_PUSH:
-        if( !we->channel.channel->full() && !we->channel.channel->closed())
+        if( we->channel.channel->canPush() && !we->channel.channel->closed())
           return idx;
         break;
       case EVT_COROUTINE_ENDS: {
@@ -324,16 +1005,28 @@ namespace Coroutines {
         if (!co_to_wait)
           return idx;
         break; }
+      case EVT_CONCURRENT_CAN_PULL:
+      case EVT_CONCURRENT_CAN_PUSH:
+        if (internal::concurrentEventReady(we))
+          return idx;
+        break;
+      case EVT_ASYNC_IO_DONE:
+        if (we->async_io.done)
+          return idx;
+        break;
       default:
         break;
       }
 
       ++idx;
     }
+    we = watched_events;
 
     // Attach to event watchers
     while (n--) {
-      if (we->event_type == EVT_CHANNEL_CAN_PULL)
+      if (we->event_type == EVT_USER_EVENT)
+        we->user.event->waiters.append(we);
+      else if (we->event_type == EVT_CHANNEL_CAN_PULL)
         we->channel.channel->waiting_for_pull.append(we);
       else if (we->event_type == EVT_CHANNEL_CAN_PUSH)
         we->channel.channel->waiting_for_push.append(we);
@@ -343,6 +1036,21 @@ namespace Coroutines {
         if (co_to_wait) 
           co_to_wait->waiting_for_me.append(we);
       }
+      else if (we->event_type == EVT_CONCURRENT_CAN_PULL) {
+        we->concurrent.channel->waiting_for_pull.append(we);
+        we->concurrent.channel->npull_waiters.fetch_add(1);
+        ++nconcurrent_waiters;
+      }
+      else if (we->event_type == EVT_CONCURRENT_CAN_PUSH) {
+        we->concurrent.channel->waiting_for_push.append(we);
+        we->concurrent.channel->npush_waiters.fetch_add(1);
+        ++nconcurrent_waiters;
+      }
+      else if (we->event_type == EVT_IO_READABLE || we->event_type == EVT_IO_WRITABLE)
+        registerIOEvent(we);
+      else if (we->event_type == EVT_ASYNC_IO_DONE) {
+        // The in flight request holds it
+      }
       else {
         // Unsupported event type
         assert(false);
@@ -351,11 +1059,9 @@ namespace Coroutines {
     }
 
     // Do we have to install a timeout event watch?
-    TWatchedEvent time_we;
     if (timeout != no_timeout) {
-      assert(timeout >= 0);
-      time_we = TWatchedEvent(timeout);
-      registerTimeoutEvent(&time_we);
+      *time_we = TWatchedEvent(timeout);
+      registerTimeoutEvent(time_we);
     }
 
     // Put ourselves to sleep
@@ -363,22 +1069,42 @@ namespace Coroutines {
     assert(co);
     co->state = internal::TCoro::WAITING_FOR_EVENT;
     co->event_waking_me_up = nullptr;
-    yield();
+
+    // Concurrent channels change without the lock. Once we are registered, 
+    // any change will wake us up, but it might have happened before. And
+    // nothing will wake us up for an fd which can't be watched
+    for (idx = 0; idx < nwatched_events; ++idx) {
+      if (internal::concurrentEventReady(watched_events + idx) || internal::ioEventFailed(watched_events + idx)) {
+        co->event_waking_me_up = watched_events + idx;
+        co->state = internal::TCoro::RUNNING;
+        break;
+      }
+    }
+    if (co->state == internal::TCoro::WAITING_FOR_EVENT)
+      return wait_must_suspend;
+    return endWait(watched_events, nwatched_events, timeout, time_we);
+  }
+
+  int internal::endWait(TWatchedEvent* watched_events, int nwatched_events, TTimeDelta timeout, TWatchedEvent* time_we) {
+    auto co = internal::byHandle(current());
+    assert(co);
     // There should be a reason to exit the waiting_for_event
     assert(co->event_waking_me_up != nullptr);
     int event_idx = 0;
 
     // If we had programmed a timeout, remove it
     if (timeout != no_timeout ) {
-      unregisterTimeoutEvent(&time_we);
+      unregisterTimeoutEvent(time_we);
       event_idx = wait_timedout;
     }
 
     // Detach from event watchers
-    n = 0; ;
-    we = watched_events;
+    int n = 0;
+    auto we = watched_events;
     while (n <  nwatched_events) {
-      if (we->event_type == EVT_CHANNEL_CAN_PULL)
+      if (we->event_type == EVT_USER_EVENT)
+        we->user.event->waiters.detach(we);
+      else if (we->event_type == EVT_CHANNEL_CAN_PULL)
         we->channel.channel->waiting_for_pull.detach(we);
       else if (we->event_type == EVT_CHANNEL_CAN_PUSH)
         we->channel.channel->waiting_for_push.detach(we);
@@ -389,6 +1115,20 @@ namespace Coroutines {
         if (co_to_wait)
           co_to_wait->waiting_for_me.detach(we);
       }
+      else if (we->event_type == EVT_CONCURRENT_CAN_PULL) {
+        we->concurrent.channel->waiting_for_pull.detach(we);
+        we->concurrent.channel->npull_waiters.fetch_sub(1);
+        --nconcurrent_waiters;
+      }
+      else if (we->event_type == EVT_CONCURRENT_CAN_PUSH) {
+        we->concurrent.channel->waiting_for_push.detach(we);
+        we->concurrent.channel->npush_waiters.fetch_sub(1);
+        --nconcurrent_waiters;
+      }
+      else if (we->event_type == EVT_IO_READABLE || we->event_type == EVT_IO_WRITABLE)
+        unregisterIOEvent(we);
+      else if (we->event_type == EVT_ASYNC_IO_DONE) {
+      }
       else {
         // Unsupported event type
         assert(false);
@@ -405,19 +1145,103 @@ namespace Coroutines {
   // ---------------------------------------------------
   void wakeUp(TWatchedEvent* we) {
     assert(we);
+    internal::TScopedLock lock;
     auto co = internal::byHandle(we->owner);
-    if (co) {
+    // Only the first event fired takes us out of the wait
+    if (co && co->state == internal::TCoro::WAITING_FOR_EVENT) {
       co->event_waking_me_up = we;
       co->state = internal::TCoro::RUNNING;
+      internal::pushReady(co);
     }
   }
 
   // ---------------------------------------------------
   void switchTo(THandle h) {
-    auto co = internal::byHandle(h);
-    if (co) {
-      co->switchTo(co);
+    using namespace internal;
+    // The target might be in the ready list of another worker
+    assert(!multithreaded);
+    auto co = byHandle(h);
+    if (!co)
+      return;
+    // Stackless ones have no context to switch to
+    assert(!co->resume_fn);
+    // Switches are always done from the running coroutine
+    auto co_curr = byHandle(current());
+    assert(co_curr && !co_curr->resume_fn);
+    auto w = thisWorker();
+    // Going back to the scheduler, it will take care of us
+    if (co == w->co_sched) {
+      co_curr->switchTo(co);
+      return;
+    }
+    saveLock(co_curr);
+    restoreLock(co);
+    w->h_current = h;
+    w->co_running = co;
+    w->nwoken = 0;
+    co_curr->switchTo(co);
+    // Main is resumed when the target switches out to it
+    if (co_curr->isMain()) {
+      switchedBack(w);
+      restoreLock(co_curr);
     }
   }
 
+  // ---------------------------------------------------
+  void setHandOffLimit(uint32_t max_chain) {
+    internal::handoff_limit = max_chain;
+  }
+
+  // ---------------------------------------------------
+  void setStackTracking(bool enabled, TStackUsedFn fn) {
+    internal::TScopedLock lock;
+    internal::track_stacks = enabled;
+    internal::on_stack_used = fn;
+    TCoroPlatform::setStackMeasurement(enabled);
+  }
+
+  std::vector<TStackUsage> stackUsage() {
+    internal::TScopedLock lock;
+    return internal::stack_sites;
+  }
+
+  void dumpStackUsage() {
+    auto sites = stackUsage();
+    printf("%10s %10s %10s %10s  %s\n", "Coros", "Mean", "Max", "Stack", "Site");
+    for (auto& s : sites)
+      printf("%10llu %10llu %10u %10u  %s\n", (unsigned long long)s.ncoroutines
+        , (unsigned long long)(s.total_used / s.ncoroutines), s.max_used, s.stack_size, s.site);
+  }
+
+  // ---------------------------------------------------
+  THandle internal::startStackless(void (*resume)(void*), void* context) {
+    TScopedLock lock;
+    auto co = findFree();
+    assert(co);                               // Run out of coroutines ids
+    if (!co)
+      return THandle();
+    co->resume_fn = resume;
+    co->resume_context = context;
+    ++nactive_coros;
+    pushReady(co);
+    return co->this_handle;
+  }
+
+  void internal::suspendStackless(void (*resume)(void*), void* context) {
+    auto co = byHandle(current());
+    assert(co && co->resume_fn);
+    co->resume_fn = resume;
+    co->resume_context = context;
+  }
+
+  // The scheduler releases the lock once we are back in its stack
+  void internal::endStackless() {
+    lock();
+    auto co = byHandle(current());
+    assert(co && co->resume_fn);
+    co->resume_fn = nullptr;
+    co->resume_context = nullptr;
+    finish(co);
+  }
+
 }
@@ -2,9 +2,16 @@
 #define INC_COROUTINES_H_
 
 #include <cstdint>
+#include <cstddef>
 #include <functional>
+#include <new>
+#include <typeinfo>
+#include <utility>
+#include <vector>
 #include "list.h"
 #include "timeline.h"
+#include "io.h"
+#include "api/coro_platform.h"
 
 namespace Coroutines {
 
@@ -12,38 +19,143 @@ namespace Coroutines {
   typedef uint8_t       u8;
 
   struct THandle {
-    uint16_t id;
-    uint16_t age;
+    uint32_t id;
+    uint32_t age;
     THandle() : id(0), age(0) {}
   };
 
   typedef std::function<bool(void)> TWaitConditionFn;
 
+  // --------------------------------------------
+  struct TStartOptions {
+    unsigned    stack_size;   // 0 for the default, 128 KB. At least 16 KB
+    const char* site;         // Groups the stack usage. By default, the type of the function
+    TStartOptions(unsigned new_stack_size = 0, const char* new_site = nullptr)
+      : stack_size(new_stack_size), site(new_site) { }
+  };
+
+  // The stack used by the coroutines started from the same site
+  struct TStackUsage {
+    const char* site;
+    uint64_t    ncoroutines;
+    uint64_t    total_used;   // The mean is total_used / ncoroutines
+    unsigned    max_used;
+    unsigned    stack_size;   // Of the last one
+  };
+  typedef void (*TStackUsedFn)(THandle h, const char* site, unsigned used, unsigned stack_size);
+
   // --------------------------------------------
   bool    isHandle(THandle h);
   THandle current();
   void    yield();
-  void    wait(TWaitConditionFn fn);
+  // Suspends the coroutine while fn returns true. The scheduler evaluates fn
+  // itself, at most once each poll_interval, and only switches back to the
+  // coroutine when it returns false
+  void    wait(TWaitConditionFn fn, TTimeDelta poll_interval = 0);
   int     executeActives();
-  void    initialize();
+  // Runs the coroutines until all of them have finished. In CLOCK_MODE_TICKS 
+  // time advances one tick per pass. When there is nothing ready to run, in
+  // CLOCK_MODE_MONOTONIC the thread sleeps until the next timeout, and in
+  // CLOCK_MODE_VIRTUAL time jumps straight to it. The fds the coroutines
+  // are waiting for are polled each pass, and the thread sleeps in the poller
+  // while there are fds to wait for.
+  void    run();
+  // Like run(), but using nthreads worker threads, this one included. Each worker
+  // has its own ready list, and steals from the others when it runs out of work.
+  // The first worker drives the timers, one tick per coroutine it runs in
+  // CLOCK_MODE_TICKS and CLOCK_MODE_VIRTUAL. In CLOCK_MODE_VIRTUAL, once all the
+  // workers are idle, time jumps to the next timeout like in run(). Returns when
+  // all coroutines have finished.
+  void    runWorkers(int nthreads);
+  // With a limit > 0, a coroutine which wakes up exactly one other and then
+  // waits for an event, switches straight to it with switchTo, instead of
+  // going through the scheduler. After max_chain handoffs in a row, the
+  // scheduler runs the other ready coroutines. 0 disables it, the default.
+  // It only applies to run/executeActives, not to runWorkers
+  void    setHandOffLimit(uint32_t max_chain);
+  // Must be called before any coroutine is started. Not all backends are
+  // available in all platforms
+  void    initialize(TCoroPlatform::eBackend backend = TCoroPlatform::BACKEND_DEFAULT);
+  // While enabled, how deep each coroutine has gone into its stack is measured
+  // when it finishes, and added to the usage of its site. fn, if given, gets
+  // each measure, with the scheduler lock taken. Enable it before starting the
+  // coroutines to measure, see TCoroPlatform::setStackMeasurement. In win32
+  // it's the stack committed, which is kept between coroutines
+  void    setStackTracking(bool enabled, TStackUsedFn fn = nullptr);
+  std::vector<TStackUsage> stackUsage();
+  void    dumpStackUsage();
 
   namespace internal {
-    THandle prologue(void (*boot)(void*), void* ctxs);
+    // While runWorkers is active, the scheduler, the channels and the timers
+    // are protected by a single lock. It can be taken several times
+    void lock();
+    void unlock();
+    struct TScopedLock {
+      TScopedLock() { lock(); }
+      ~TScopedLock() { unlock(); }
+    };
+
+    // False in the main coroutine, in the workers schedulers and in
+    // threads not running coroutines
+    bool inCoroutine();
+
+    // The TFuture which will receive the result of a coroutine started by
+    // async. It follows the future when it's moved. Take the lock to use it
+    void  setFuture(THandle h, void* future);
+    void* currentFuture();
+
+    // Each coroutine keeps its closure in its slot. Bigger ones, or
+    // with a bigger alignment, go to the heap
+    static const size_t closure_inline_size = 64;
+    static const size_t closure_inline_align = 16;
+
+    // move_closure builds the closure in the new coroutine from the one at src
+    THandle prologue(void (*boot)(void*), void (*move_closure)(void* dst, void* src), void* src, size_t size, size_t align, const TStartOptions& options, const char* default_site);
+    void epilogue();
 
     template< typename TFn >
     static void bootstrap(void* context) {
       TFn* fn = static_cast<TFn*> (context);
       (*fn)();
+      fn->~TFn();
       epilogue( );
     }
 
-    void epilogue();
+    template< typename TFn >
+    static void moveClosure(void* dst, void* src) {
+      new (dst) TFn(std::move(*static_cast<TFn*>(src)));
+    }
+
+    void waitWhile(bool (*must_wait)(void*), void* context, TTimeDelta poll_interval);
+
+    template< typename TPred >
+    static bool callPredicate(void* context) {
+      return (*static_cast<TPred*>(context))();
+    }
+
+    // Stackless coroutines, see task.h. They have a slot but no stack, and
+    // run in the stack of the scheduler, which calls resume(context) each
+    // time they are ready. startStackless makes it ready. suspendStackless is
+    // called by the running one, with the lock taken, before returning to the
+    // scheduler, and endStackless when it has finished
+    THandle startStackless(void (*resume)(void*), void* context);
+    void    suspendStackless(void (*resume)(void*), void* context);
+    void    endStackless();
   }
 
   // --------------------------
+  // fn is moved into the new coroutine, so it can use its captures for its
+  // whole life. Returns an invalid handle if its stack can't be allocated
   template< typename TFn >
-  THandle start(TFn fn) {
-    return internal::prologue( &internal::bootstrap<TFn>, &fn);
+  THandle start(TFn fn, const TStartOptions& options = TStartOptions()) {
+    return internal::prologue( &internal::bootstrap<TFn>, &internal::moveClosure<TFn>, &fn, sizeof(TFn), alignof(TFn), options, typeid(TFn).name());
+  }
+
+  // Same as wait(fn), but pred is not converted to a TWaitConditionFn, so
+  // it never allocates. The scheduler calls it where it is, in our stack
+  template< typename TPred >
+  void waitWhile(TPred pred, TTimeDelta poll_interval = 0) {
+    internal::waitWhile(&internal::callPredicate<TPred>, &pred, poll_interval);
   }
 
   enum eEventType {
@@ -52,32 +164,60 @@ namespace Coroutines {
   , EVT_CHANNEL_CAN_PULL
   , EVT_TIMEOUT
   , EVT_COROUTINE_ENDS
+  , EVT_CONCURRENT_CAN_PUSH
+  , EVT_CONCURRENT_CAN_PULL
+  , EVT_IO_READABLE
+  , EVT_IO_WRITABLE
+  , EVT_ASYNC_IO_DONE
   , EVT_INVALID
   , EVT_TYPES_COUNT
   };
 
   // --------------------------
-  class TChannel;
+  class TChannelBase;
+  class TConcurrentChannel;
+  class TEvent;
   struct TWatchedEvent : public TListItem {
     THandle        owner;         // maps to current()
     eEventType     event_type;    // Set by the ctor
 
     union {
+
+      struct {
+        TEvent*    event;
+      } user;
       
       struct {
-        TChannel*  channel;
-        void*      data_addr;
-        size_t     data_size;
+        TChannelBase* channel;
+        void*         data_addr;
+        size_t        data_size;
+        bool          handoff;      // The other side can move the item from/to data_addr
+        bool          handed_off;   // and it did it
       } channel;
 
       struct {
         TTimeStamp time_programmed;    // Timestamp when it was programmed
         TTimeStamp time_to_trigger;    // Timestamp when will fire
+        TList*     slot;               // Timer wheel slot holding us, null when not registered
       } time;
 
       struct {
         THandle    handle;
       } coroutine;
+
+      struct {
+        TConcurrentChannel* channel;
+      } concurrent;
+
+      struct {
+        TFd        fd;
+        int        error;         // -errno when the fd can't be watched
+      } io;
+
+      struct {
+        int64_t    result;        // As returned by read/write, or -errno
+        bool       done;
+      } async_io;
     
     };
 
@@ -86,15 +226,45 @@ namespace Coroutines {
 
     // Wait until the we can push/pull an item into/from that channel
     template< class TObj >
-    TWatchedEvent(TChannel* new_channel, const TObj &obj, eEventType evt)
+    TWatchedEvent(TChannelBase* new_channel, const TObj &obj, eEventType evt)
     {
       channel.channel = new_channel;
       channel.data_addr = (TObj*) &obj;
       channel.data_size = sizeof(TObj);
+      channel.handoff = false;
+      channel.handed_off = false;
       event_type = evt;
       owner = current();
     }
 
+    // Same, when the item is accessed in place, with beginPush/beginPull
+    TWatchedEvent(TChannelBase* new_channel, eEventType evt)
+    {
+      channel.channel = new_channel;
+      channel.data_addr = nullptr;
+      channel.data_size = 0;
+      channel.handoff = false;
+      channel.handed_off = false;
+      event_type = evt;
+      owner = current();
+    }
+
+    template< class TObj >
+    TWatchedEvent(TConcurrentChannel* new_channel, const TObj &, eEventType evt)
+    {
+      concurrent.channel = new_channel;
+      event_type = evt;
+      owner = current();
+    }
+
+    // Wait until the event is set or notified
+    TWatchedEvent(TEvent* new_event)
+    {
+      user.event = new_event;
+      event_type = EVT_USER_EVENT;
+      owner = current();
+    }
+
     // Wait until the coroutine has finished
     TWatchedEvent(THandle handle_to_wait)
     {
@@ -103,10 +273,28 @@ namespace Coroutines {
       owner = current();
     }
 
+    // Wait until the fd can be read or written, evt is EVT_IO_READABLE or EVT_IO_WRITABLE
+    TWatchedEvent(TFd fd, eEventType evt) {
+      io.fd = fd;
+      io.error = 0;
+      event_type = evt;
+      owner = current();
+    }
+
+    // Used by asyncRead/asyncWrite, while the request is in flight
+    TWatchedEvent(eEventType evt) {
+      assert(evt == EVT_ASYNC_IO_DONE);
+      async_io.result = 0;
+      async_io.done = false;
+      event_type = evt;
+      owner = current();
+    }
+
     TWatchedEvent(TTimeDelta timeout) {
       event_type = EVT_TIMEOUT;
       time.time_programmed = now();
       time.time_to_trigger= now() + timeout;
+      time.slot = nullptr;
       owner = current();
     }
 
@@ -119,6 +307,26 @@ namespace Coroutines {
   void wakeUp(TWatchedEvent* we);
   void switchTo(THandle h);
 
+  namespace internal {
+    // wait() in two halves, for those who can't suspend in the middle of a
+    // function. With the lock taken, beginWait returns the index of an event
+    // already set, or wait_timedout, or wait_must_suspend after attaching to
+    // all of them. Then the caller suspends, keeping the lock, and endWait
+    // detaches from them once it's woken up. time_we is only used with a timeout
+    static const int wait_must_suspend = -2;
+    int beginWait(TWatchedEvent* watched_events, int nwatched_events, TTimeDelta timeout, TWatchedEvent* time_we);
+    int endWait(TWatchedEvent* watched_events, int nwatched_events, TTimeDelta timeout, TWatchedEvent* time_we);
+
+    // True in the threads which can't wake up coroutines themselves: any but
+    // the one running the scheduler, while it runs in a single thread with
+    // run or executeActives. A concurrent channel used from them posts its
+    // wakes, which the scheduler does in its next pass, up to n waiters
+    // for evt. The channel cancels them when it's destroyed
+    bool isForeignThread();
+    void postChannelWake(TConcurrentChannel* ch, eEventType evt, int n);
+    void cancelChannelWakes(TConcurrentChannel* ch);
+  }
+
 }
 
 #endif
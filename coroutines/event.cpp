@@ -0,0 +1,36 @@
+#include "event.h"
+
+namespace Coroutines {
+
+  void TEvent::set() {
+    internal::TScopedLock lock;
+    is_set = true;
+    notifyAll();
+  }
+
+  void TEvent::reset() {
+    internal::TScopedLock lock;
+    is_set = false;
+  }
+
+  void TEvent::notifyOne() {
+    internal::TScopedLock lock;
+    auto we = waiters.detachFirst< TWatchedEvent >();
+    if (we) {
+      assert(we->user.event == this);
+      wakeUp(we);
+    }
+  }
+
+  void TEvent::notifyAll() {
+    internal::TScopedLock lock;
+    while (auto we = waiters.detachFirst< TWatchedEvent >())
+      wakeUp(we);
+  }
+
+  bool TEvent::wait(TTimeDelta timeout) {
+    TWatchedEvent we(this);
+    return Coroutines::wait(&we, 1, timeout) != wait_timedout;
+  }
+
+}
@@ -0,0 +1,37 @@
+#ifndef INC_COROUTINES_EVENT_H_
+#define INC_COROUTINES_EVENT_H_
+
+#include "list.h"
+#include "coroutines.h"
+
+namespace Coroutines {
+
+  // ----------------------------------------
+  // Coroutines wait for it with EVT_USER_EVENT, alone or together with other
+  // events. While set, waiting for it returns at once, like a manual reset
+  // event. notifyOne/notifyAll wake up the current waiters without setting
+  // it, like a condition variable. Waiters cost nothing until woken up.
+  class TEvent {
+    bool   is_set;
+
+  public:
+    TList  waiters;
+
+  public:
+    TEvent() : is_set(false) { }
+    TEvent(const TEvent&) = delete;
+    TEvent& operator=(const TEvent&) = delete;
+
+    bool isSet() const { return is_set; }
+    void set();
+    void reset();
+    void notifyOne();
+    void notifyAll();
+
+    // Returns false if the timeout expires first. Must be called from a coroutine
+    bool wait(TTimeDelta timeout = no_timeout);
+  };
+
+}
+
+#endif
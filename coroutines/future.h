@@ -0,0 +1,188 @@
+#ifndef INC_COROUTINES_FUTURE_H_
+#define INC_COROUTINES_FUTURE_H_
+
+#include <new>
+#include <utility>
+#include "coroutines.h"
+
+namespace Coroutines {
+
+  namespace internal {
+    template< typename T >
+    struct TAsyncRunner;
+  }
+
+  // ----------------------------------------
+  // The result of a coroutine started with async. The value is stored in the
+  // future itself, no allocations. The coroutine keeps the address of the
+  // future, which is updated when the future is moved, so it can be returned
+  // by value. If the future is destroyed before the coroutine ends, the
+  // result is discarded. get() suspends the calling coroutine until the
+  // result is ready, waiting for EVT_COROUTINE_ENDS.
+  template< typename T >
+  class TFuture {
+    THandle handle;
+    bool    has_value;
+    alignas(T) unsigned char storage[sizeof(T)];
+
+    friend struct internal::TAsyncRunner<T>;
+
+    T* addrOfValue() { return reinterpret_cast<T*>(storage); }
+
+    void waitForValue() {
+      internal::TScopedLock lock;
+      if (has_value)
+        return;
+      assert(internal::inCoroutine());
+      TWatchedEvent we(handle);
+      Coroutines::wait(&we, 1);
+      assert(has_value);
+    }
+
+  public:
+    TFuture() : has_value(false) { }
+    TFuture(TFuture&& other) : has_value(false) {
+      internal::TScopedLock lock;
+      handle = other.handle;
+      if (other.has_value)
+        setValue(std::move(*other.addrOfValue()));
+      internal::setFuture(handle, this);
+      other.handle = THandle();
+    }
+    ~TFuture() {
+      internal::TScopedLock lock;
+      internal::setFuture(handle, nullptr);
+      if (has_value)
+        addrOfValue()->~T();
+    }
+    TFuture(const TFuture&) = delete;
+    TFuture& operator=(const TFuture&) = delete;
+    TFuture& operator=(TFuture&&) = delete;
+
+    // Set by the coroutine, with the lock taken
+    void setValue(T&& new_value) {
+      assert(!has_value);
+      new (addrOfValue()) T(std::move(new_value));
+      has_value = true;
+    }
+
+    bool ready() const {
+      internal::TScopedLock lock;
+      return has_value;
+    }
+
+    // Valid while the future exists
+    T& get() {
+      waitForValue();
+      return *addrOfValue();
+    }
+
+    THandle coroutine() const { return handle; }
+  };
+
+  // ----------------------------------------
+  template<>
+  class TFuture<void> {
+    THandle handle;
+
+    friend struct internal::TAsyncRunner<void>;
+
+  public:
+    TFuture() { }
+    TFuture(TFuture&& other) : handle(other.handle) { other.handle = THandle(); }
+    TFuture(const TFuture&) = delete;
+    TFuture& operator=(const TFuture&) = delete;
+    TFuture& operator=(TFuture&&) = delete;
+
+    bool ready() const { return !isHandle(handle); }
+    void get() {
+      if (ready())
+        return;
+      assert(internal::inCoroutine());
+      TWatchedEvent we(handle);
+      Coroutines::wait(&we, 1);
+    }
+
+    THandle coroutine() const { return handle; }
+  };
+
+  namespace internal {
+
+    // Sends the result to wherever the future is when fn returns
+    template< typename T >
+    struct TAsyncRunner {
+      template< typename TFn >
+      static void run(TFn& fn, TFuture<T>* future) {
+        setFuture(current(), future);
+        T result = fn();
+        TScopedLock lock;
+        if (auto f = static_cast<TFuture<T>*>(currentFuture()))
+          f->setValue(std::move(result));
+      }
+      template< typename TFn >
+      static void runInline(TFn& fn, TFuture<T>& future) {
+        T result = fn();
+        TScopedLock lock;
+        future.setValue(std::move(result));
+      }
+      static void attach(TFuture<T>& future, THandle h) {
+        TScopedLock lock;
+        future.handle = h;
+      }
+    };
+
+    template<>
+    struct TAsyncRunner<void> {
+      template< typename TFn >
+      static void run(TFn& fn, TFuture<void>*) {
+        fn();
+      }
+      template< typename TFn >
+      static void runInline(TFn& fn, TFuture<void>&) {
+        fn();
+      }
+      static void attach(TFuture<void>& future, THandle h) {
+        future.handle = h;
+      }
+    };
+
+    // What fn returns, called as TAsyncRunner calls it
+    template< typename TFn >
+    using TResultOf = decltype(std::declval<TFn&>()());
+
+    // The closure of the coroutine. Only moved into it when it starts, so
+    // async still has fn when it can't be started
+    template< typename TFn >
+    struct TAsyncBody {
+      TFn                         fn;
+      TFuture< TResultOf<TFn> >*  future;
+      void operator()() { TAsyncRunner< TResultOf<TFn> >::run(fn, future); }
+    };
+
+  }
+
+  // --------------------------
+  // Like start, but the value returned by fn can be retrieved with the future.
+  // If the coroutine can't be started (no memory for its stack), fn runs
+  // right here instead, and the future is returned ready, with no coroutine
+  template< typename TFn >
+  TFuture< internal::TResultOf<TFn> > async(TFn fn, const TStartOptions& options = TStartOptions()) {
+    typedef internal::TResultOf<TFn> T;
+    typedef internal::TAsyncBody<TFn> TBody;
+    TFuture<T> future;
+    TBody body{ std::move(fn), &future };
+    THandle h = internal::prologue(&internal::bootstrap<TBody>, &internal::moveClosure<TBody>, &body, sizeof(TBody), alignof(TBody), options, typeid(TFn).name());
+    // Not isHandle(h), which is also false when fn has already finished.
+    // Real handles start at age 1
+    if (h.age == 0) {
+      internal::TAsyncRunner<T>::runInline(body.fn, future);
+      return future;
+    }
+    // Moving it updates the address kept by the coroutine
+    internal::TAsyncRunner<T>::attach(future, h);
+    return future;
+  }
+
+}
+
+#endif
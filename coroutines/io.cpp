@@ -0,0 +1,564 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#include "io.h"
+#include "coroutines.h"
+#include <atomic>
+#include <cerrno>
+#include <unordered_map>
+#include <vector>
+
+// Linux uses epoll and io_uring. Elsewhere the fds are polled with poll/WSAPoll
+#ifdef __linux__
+  #define CORO_IO_EPOLL
+  #define CORO_IO_URING
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/syscall.h>
+  #include <linux/io_uring.h>
+  #include <cstring>
+  #include <unistd.h>
+#elif !defined(_WIN32)
+  #include <poll.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+namespace Coroutines {
+
+  namespace {
+
+    enum {
+      IO_READ = 1
+    , IO_WRITE = 2
+    };
+
+    struct TFdWatchers {
+      TFd       fd;
+      TList     readers;
+      TList     writers;
+      uint32_t  armed;       // What the poller is watching for this fd
+      bool      in_poller;
+      TFdWatchers() : fd(0), armed(0), in_poller(false) { }
+      uint32_t wanted() const {
+        return (readers.empty() ? 0 : IO_READ) | (writers.empty() ? 0 : IO_WRITE);
+      }
+    };
+
+    // Bigger requests are cut short, like read/write do
+    const size_t max_request_len = 0x7fffffff;
+
+    // Entries are never removed, so their addresses are stable, and a fd
+    // reused after being closed finds its entry again
+    std::unordered_map< TFd, TFdWatchers > fds;
+    std::atomic<int> nwatchers(0);      // Read by the poller without the lock
+
+#ifdef CORO_IO_EPOLL
+    int epoll_fd = -1;
+
+    // Written by interruptPollIO, from any thread, to wake up epoll_wait
+    std::atomic<int> wake_fd(-1);
+    char wake_epoll_tag;
+
+    void createEpoll() {
+      if (epoll_fd >= 0)
+        return;
+      epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+      assert(epoll_fd >= 0);
+      int fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      assert(fd >= 0);
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &wake_epoll_tag;
+      int rc = ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+      assert(rc == 0);
+      wake_fd = fd;
+    }
+
+    // Returns 0, or -errno when the fd can't be watched. EPERM for the
+    // regular files and the block devices
+    int arm(TFdWatchers& w, uint32_t mask) {
+      createEpoll();
+      // Left in the set, epoll would keep reporting its errors and hangups
+      if (!mask) {
+        // It fails if the fd was closed, and then it's already out
+        if (w.in_poller)
+          ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w.fd, nullptr);
+        w.in_poller = false;
+        w.armed = 0;
+        return 0;
+      }
+      struct epoll_event ev;
+      ev.events = 0;
+      if (mask & IO_READ)
+        ev.events |= EPOLLIN;
+      if (mask & IO_WRITE)
+        ev.events |= EPOLLOUT;
+      ev.data.ptr = &w;
+      // The kernel forgets the fd when it's closed, and the user might have
+      // opened another one with the same number
+      int op = w.in_poller ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+      int rc = ::epoll_ctl(epoll_fd, op, w.fd, &ev);
+      if (rc < 0 && errno == ENOENT) {
+        op = EPOLL_CTL_ADD;
+        rc = ::epoll_ctl(epoll_fd, op, w.fd, &ev);
+      }
+      else if (rc < 0 && errno == EEXIST) {
+        op = EPOLL_CTL_MOD;
+        rc = ::epoll_ctl(epoll_fd, op, w.fd, &ev);
+      }
+      if (rc < 0) {
+        int err = errno;
+        // A failed ADD leaves it out, a failed MOD with the previous mask
+        if (op == EPOLL_CTL_ADD) {
+          w.in_poller = false;
+          w.armed = 0;
+        }
+        return -err;
+      }
+      w.in_poller = true;
+      w.armed = mask;
+      return 0;
+    }
+#else
+    int arm(TFdWatchers& w, uint32_t mask) {
+      w.armed = mask;
+      return 0;
+    }
+#endif
+
+    // ----------------------------------------------------------
+    void dispatch(TFdWatchers& w, uint32_t ready) {
+      // Level triggered. We keep watching after waking up the waiters, as they
+      // will probably wait again. Only when the fd fires and nobody is waiting,
+      // we stop watching it. With nothing left to watch, it leaves the poller
+      uint32_t unwanted = ready & ~w.wanted();
+      if (ready & IO_READ) {
+        while (auto we = w.readers.detachFirst< TWatchedEvent >())
+          wakeUp(we);
+      }
+      if (ready & IO_WRITE) {
+        while (auto we = w.writers.detachFirst< TWatchedEvent >())
+          wakeUp(we);
+      }
+      if ((unwanted & w.armed) && arm(w, w.armed & ~unwanted) < 0) {
+        // The fd was closed. Those left will find it in their next read/write
+        while (auto we = w.readers.detachFirst< TWatchedEvent >())
+          wakeUp(we);
+        while (auto we = w.writers.detachFirst< TWatchedEvent >())
+          wakeUp(we);
+      }
+    }
+
+#ifdef CORO_IO_URING
+    // ----------------------------------------------------------
+    // The rings are shared with the kernel, we only write our side of them: the
+    // sq tail and the cq head. Requests are queued in the sq without any syscall,
+    // and submitted together the next time pollIO runs. Completions are read
+    // straight from the cq, and the ring fd is watched by epoll so pollIO can
+    // sleep waiting for them.
+    struct TRing {
+      int                  fd;
+      unsigned*            sq_head;
+      unsigned*            sq_tail;
+      unsigned             sq_mask;
+      unsigned             sq_entries;
+      unsigned*            sq_array;
+      struct io_uring_sqe* sqes;
+      unsigned*            cq_head;
+      unsigned*            cq_tail;
+      unsigned             cq_mask;
+      struct io_uring_cqe* cqes;
+      unsigned             nqueued;      // In the sq, not yet submitted
+      std::atomic<int>     nin_flight;   // Queued or submitted, not yet reaped
+      bool                 tried;
+      TRing() : fd(-1), nqueued(0), nin_flight(0), tried(false) { }
+    };
+
+    TRing ring;
+    const unsigned ring_entries = 256;
+    bool ring_enabled = true;         // See setIOUring
+
+    // Identifies the ring fd in the epoll events
+    char ring_epoll_tag;
+
+    bool setupRing() {
+      if (ring.tried)
+        return ring.fd >= 0;
+      ring.tried = true;
+
+      struct io_uring_params p;
+      memset(&p, 0x00, sizeof(p));
+      int fd = (int)::syscall(__NR_io_uring_setup, ring_entries, &p);
+      if (fd < 0)
+        return false;
+      // Older kernels need each ring mapped on its own
+      if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        ::close(fd);
+        return false;
+      }
+
+      size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+      size_t rings_size = sq_size > cq_size ? sq_size : cq_size;
+      auto rings = (char*)::mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      auto sqes = ::mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        ::close(fd);
+        return false;
+      }
+
+      ring.sq_head = (unsigned*)(rings + p.sq_off.head);
+      ring.sq_tail = (unsigned*)(rings + p.sq_off.tail);
+      ring.sq_mask = *(unsigned*)(rings + p.sq_off.ring_mask);
+      ring.sq_entries = p.sq_entries;
+      ring.sq_array = (unsigned*)(rings + p.sq_off.array);
+      ring.sqes = (struct io_uring_sqe*)sqes;
+      ring.cq_head = (unsigned*)(rings + p.cq_off.head);
+      ring.cq_tail = (unsigned*)(rings + p.cq_off.tail);
+      ring.cq_mask = *(unsigned*)(rings + p.cq_off.ring_mask);
+      ring.cqes = (struct io_uring_cqe*)(rings + p.cq_off.cqes);
+      ring.fd = fd;
+
+      createEpoll();
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &ring_epoll_tag;
+      int rc = ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+      assert(rc == 0);
+      return true;
+    }
+
+    // Hands the queued requests to the kernel
+    void submitRing() {
+      while (ring.nqueued > 0) {
+        int rc = (int)::syscall(__NR_io_uring_enter, ring.fd, ring.nqueued, 0, 0, nullptr, 0);
+        if (rc < 0) {
+          // The kernel is out of memory for requests, try again later
+          if (errno == EAGAIN || errno == EBUSY)
+            return;
+          assert(errno == EINTR);
+          continue;
+        }
+        ring.nqueued -= rc;
+      }
+    }
+
+    // Wakes up the owners of the completed requests
+    void reapRing() {
+      unsigned head = *ring.cq_head;
+      unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+        auto cqe = &ring.cqes[head & ring.cq_mask];
+        auto we = (TWatchedEvent*)(uintptr_t)cqe->user_data;
+        assert(we && we->event_type == EVT_ASYNC_IO_DONE);
+        we->async_io.result = cqe->res;
+        we->async_io.done = true;
+        wakeUp(we);
+        --ring.nin_flight;
+        ++head;
+      }
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // With the lock taken. False if the ring is not available
+    bool queueRequest(uint8_t opcode, TFd fd, const void* buf, size_t len, int64_t off, TWatchedEvent* we) {
+      if (!ring_enabled || !setupRing())
+        return false;
+      unsigned tail = *ring.sq_tail;
+      // The sq is full, make room
+      if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        submitRing();
+        if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries)
+          return false;
+      }
+      unsigned idx = tail & ring.sq_mask;
+      auto sqe = &ring.sqes[idx];
+      memset(sqe, 0x00, sizeof(*sqe));
+      sqe->opcode = opcode;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t)buf;
+      sqe->len = (uint32_t)(len > max_request_len ? max_request_len : len);
+      sqe->off = (uint64_t)off;
+      sqe->user_data = (uint64_t)(uintptr_t)we;
+      ring.sq_array[idx] = idx;
+      __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+      ++ring.nqueued;
+      ++ring.nin_flight;
+      return true;
+    }
+
+    int64_t asyncRequest(uint8_t opcode, TFd fd, const void* buf, size_t len, int64_t off, bool& queued) {
+      TWatchedEvent we(EVT_ASYNC_IO_DONE);
+      {
+        internal::TScopedLock lock;
+        queued = queueRequest(opcode, fd, buf, len, off, &we);
+        if (!queued)
+          return 0;
+        // Nothing else can take us out, and we must not leave while the
+        // kernel can still write in we
+        while (!we.async_io.done)
+          wait(&we, 1);
+      }
+      return we.async_io.result;
+    }
+#endif
+
+#ifndef _WIN32
+    // Regular files and block devices are always ready, and epoll rejects them
+    bool isPollable(TFd fd) {
+      struct stat st;
+      if (::fstat(fd, &st) != 0)
+        return true;              // The read/write will report it
+      return !S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode);
+    }
+#endif
+
+    int toMilliseconds(TTimeDelta max_wait) {
+      if (max_wait == io_no_timeout)
+        return -1;
+      // Round up, or we would spin until the timeout
+      TTimeDelta ms = (max_wait + 999999) / 1000000;
+      return ms > 0x7fffffff ? 0x7fffffff : (int)ms;
+    }
+
+  }
+
+  // ----------------------------------------------------------
+  void registerIOEvent(TWatchedEvent* we) {
+    internal::TScopedLock lock;
+    auto& w = fds[we->io.fd];
+    w.fd = we->io.fd;
+    if (we->event_type == EVT_IO_READABLE)
+      w.readers.append(we);
+    else {
+      assert(we->event_type == EVT_IO_WRITABLE);
+      w.writers.append(we);
+    }
+    ++nwatchers;
+    uint32_t wanted = w.wanted();
+    if (wanted & ~w.armed) {
+      int rc = arm(w, w.armed | wanted);
+      // wait() returns right away, unregisterIOEvent is still called
+      if (rc < 0) {
+        we->io.error = rc;
+        w.readers.detach(we);
+        w.writers.detach(we);
+      }
+    }
+  }
+
+  void unregisterIOEvent(TWatchedEvent* we) {
+    internal::TScopedLock lock;
+    auto& w = fds[we->io.fd];
+    // Already detached if the fd woke us up
+    if (we->event_type == EVT_IO_READABLE)
+      w.readers.detach(we);
+    else
+      w.writers.detach(we);
+    --nwatchers;
+  }
+
+  // The kernel drops the fd from epoll when it's closed, so we don't need
+  // to ask for it, just to remember it's not there
+  void forgetFd(TFd fd) {
+    internal::TScopedLock lock;
+    auto it = fds.find(fd);
+    if (it == fds.end())
+      return;
+    auto& w = it->second;
+    assert(w.readers.empty() && w.writers.empty());
+    w.armed = 0;
+    w.in_poller = false;
+  }
+
+  bool ioEventsPending() {
+#ifdef CORO_IO_URING
+    if (ring.nin_flight > 0)
+      return true;
+#endif
+    return nwatchers > 0;
+  }
+
+  // ----------------------------------------------------------
+  void pollIO(TTimeDelta max_wait) {
+    if (!ioEventsPending())
+      return;
+
+#ifdef CORO_IO_EPOLL
+#ifdef CORO_IO_URING
+    // One syscall for all the requests queued since the last call. Some
+    // might have already completed
+    if (ring.nin_flight > 0) {
+      internal::TScopedLock lock;
+      int nbefore = ring.nin_flight;
+      submitRing();
+      reapRing();
+      if (ring.nin_flight < nbefore)
+        max_wait = 0;
+    }
+#endif
+    const int max_events = 256;
+    struct epoll_event events[max_events];
+    int n = ::epoll_wait(epoll_fd, events, max_events, toMilliseconds(max_wait));
+    internal::TScopedLock lock;
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.ptr == &wake_epoll_tag) {
+        uint64_t count;
+        while (::read(wake_fd, &count, sizeof(count)) > 0) { }
+        continue;
+      }
+#ifdef CORO_IO_URING
+      if (events[i].data.ptr == &ring_epoll_tag) {
+        reapRing();
+        continue;
+      }
+#endif
+      auto w = static_cast<TFdWatchers*>(events[i].data.ptr);
+      uint32_t ready = 0;
+      // Errors and hangups wake up everybody, the next read/write will report them
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        ready |= IO_READ;
+      if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        ready |= IO_WRITE;
+      dispatch(*w, ready);
+    }
+
+#else
+
+#ifdef _WIN32
+    typedef WSAPOLLFD TPollFd;
+#else
+    typedef struct pollfd TPollFd;
+#endif
+    std::vector< TPollFd > pfds;
+    std::vector< TFdWatchers* > watchers;
+    {
+      internal::TScopedLock lock;
+      for (auto& it : fds) {
+        auto& w = it.second;
+        if (!w.armed)
+          continue;
+        TPollFd pfd;
+        pfd.fd = w.fd;
+        pfd.events = ((w.armed & IO_READ) ? POLLIN : 0) | ((w.armed & IO_WRITE) ? POLLOUT : 0);
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+        watchers.push_back(&w);
+      }
+    }
+#ifdef _WIN32
+    int n = ::WSAPoll(pfds.data(), (ULONG)pfds.size(), toMilliseconds(max_wait));
+#else
+    int n = ::poll(pfds.data(), pfds.size(), toMilliseconds(max_wait));
+#endif
+    if (n <= 0)
+      return;
+    internal::TScopedLock lock;
+    for (size_t i = 0; i < pfds.size(); ++i) {
+      uint32_t ready = 0;
+      if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+        ready |= IO_READ;
+      if (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP))
+        ready |= IO_WRITE;
+      if (ready)
+        dispatch(*watchers[i], ready);
+    }
+#endif
+  }
+
+  // ----------------------------------------------------------
+  void interruptPollIO() {
+#ifdef CORO_IO_EPOLL
+    // Before the poller exists nobody can be blocked in it
+    int fd = wake_fd;
+    if (fd < 0)
+      return;
+    uint64_t one = 1;
+    ssize_t rc = ::write(fd, &one, sizeof(one));
+    (void)rc;
+#endif
+  }
+
+  bool canInterruptPollIO() {
+#ifdef CORO_IO_EPOLL
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // ----------------------------------------------------------
+  void setIOUring(bool enabled) {
+#ifdef CORO_IO_URING
+    internal::TScopedLock lock;
+    ring_enabled = enabled;
+#endif
+  }
+
+  int64_t asyncRead(TFd fd, void* buf, size_t len, int64_t off) {
+#ifdef CORO_IO_URING
+    bool queued;
+    int64_t rc = asyncRequest(IORING_OP_READ, fd, buf, len, off, queued);
+    if (queued)
+      return rc;
+#endif
+#ifdef _WIN32
+    assert(off == -1);
+    waitReadable(fd);
+    int rc_win = ::recv(fd, (char*)buf, (int)(len > max_request_len ? max_request_len : len), 0);
+    return rc_win < 0 ? -(int64_t)::WSAGetLastError() : rc_win;
+#else
+    // Some other fds are rejected by epoll too, with EPERM
+    if (isPollable(fd) && !waitReadable(fd) && errno != EPERM)
+      return -(int64_t)errno;
+    ssize_t rc_sync = (off == -1) ? ::read(fd, buf, len) : ::pread(fd, buf, len, (off_t)off);
+    return rc_sync < 0 ? -(int64_t)errno : rc_sync;
+#endif
+  }
+
+  int64_t asyncWrite(TFd fd, const void* buf, size_t len, int64_t off) {
+#ifdef CORO_IO_URING
+    bool queued;
+    int64_t rc = asyncRequest(IORING_OP_WRITE, fd, buf, len, off, queued);
+    if (queued)
+      return rc;
+#endif
+#ifdef _WIN32
+    assert(off == -1);
+    waitWritable(fd);
+    int rc_win = ::send(fd, (const char*)buf, (int)(len > max_request_len ? max_request_len : len), 0);
+    return rc_win < 0 ? -(int64_t)::WSAGetLastError() : rc_win;
+#else
+    if (isPollable(fd) && !waitWritable(fd) && errno != EPERM)
+      return -(int64_t)errno;
+    ssize_t rc_sync = (off == -1) ? ::write(fd, buf, len) : ::pwrite(fd, buf, len, (off_t)off);
+    return rc_sync < 0 ? -(int64_t)errno : rc_sync;
+#endif
+  }
+
+  // ----------------------------------------------------------
+  bool waitReadable(TFd fd, TTimeDelta timeout) {
+    TWatchedEvent we(fd, EVT_IO_READABLE);
+    int idx = wait(&we, 1, timeout);
+    if (we.io.error) {
+      errno = (int)-we.io.error;
+      return false;
+    }
+    return idx != wait_timedout;
+  }
+
+  bool waitWritable(TFd fd, TTimeDelta timeout) {
+    TWatchedEvent we(fd, EVT_IO_WRITABLE);
+    int idx = wait(&we, 1, timeout);
+    if (we.io.error) {
+      errno = (int)-we.io.error;
+      return false;
+    }
+    return idx != wait_timedout;
+  }
+
+}
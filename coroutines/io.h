@@ -0,0 +1,60 @@
+#ifndef INC_COROUTINES_IO_H_
+#define INC_COROUTINES_IO_H_
+
+#include <cstdint>
+#include <cstddef>
+#include "timeline.h"
+
+namespace Coroutines {
+
+#ifdef _WIN32
+  typedef uintptr_t TFd;        // A SOCKET
+#else
+  typedef int       TFd;
+#endif
+
+  struct TWatchedEvent;
+
+  // Same value as no_timeout
+  static const TTimeDelta io_no_timeout = ~((TTimeDelta)0);
+
+  // Used by wait() for the EVT_IO_READABLE and EVT_IO_WRITABLE events
+  void registerIOEvent(TWatchedEvent* we);
+  void unregisterIOEvent(TWatchedEvent* we);
+  // Must be called before closing an fd that coroutines have waited for, as
+  // the number will be reused by the system. Nobody can be waiting for it
+  void forgetFd(TFd fd);
+  // True while some coroutine is waiting for an fd or an async request
+  bool ioEventsPending();
+  // Wakes up the coroutines waiting for the fds which are ready, blocking the
+  // thread up to max_wait nanoseconds until one is. run() and runWorkers call
+  // it, hosts calling executeActives must call it too.
+  void pollIO(TTimeDelta max_wait);
+  // Makes the thread blocked in pollIO return, from any thread. Only where
+  // canInterruptPollIO, with epoll. Elsewhere it does nothing
+  void interruptPollIO();
+  bool canInterruptPollIO();
+
+  // Read/write up to len bytes at offset off, or at the current position when
+  // off is -1, suspending the coroutine until done. Return what read/write 
+  // would, or -errno. In linux the requests are queued in an io_uring and
+  // submitted together by pollIO. Elsewhere, or if the kernel has no io_uring,
+  // they wait until the fd is ready and call read/write. Regular files and
+  // block devices, which can't be polled, are read/written right away. As
+  // with read/write, less than len can be done, at most 2 GB per call.
+  int64_t asyncRead(TFd fd, void* buf, size_t len, int64_t off = -1);
+  int64_t asyncWrite(TFd fd, const void* buf, size_t len, int64_t off = -1);
+  // The io_uring is used when the kernel has it, unless disabled here. The
+  // requests already queued are not affected
+  void setIOUring(bool enabled);
+
+  // Suspend the coroutine until the fd can be read/written without blocking.
+  // Return false if the timeout expired first, or right away, with errno
+  // set, if the fd can't be watched. epoll rejects regular files with EPERM
+  bool waitReadable(TFd fd, TTimeDelta timeout = io_no_timeout);
+  bool waitWritable(TFd fd, TTimeDelta timeout = io_no_timeout);
+
+}
+
+#endif
+
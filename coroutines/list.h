@@ -39,6 +39,9 @@ namespace Coroutines {
         item->next->prev = item->prev;
       else if (last == item)
         last = item->prev;
+      // So it can be appended again, or detached twice
+      item->prev = nullptr;
+      item->next = nullptr;
     }
     template< class T >
     T* detachFirst() {
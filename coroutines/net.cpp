@@ -0,0 +1,309 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#include "net.h"
+#include "coroutines.h"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+
+namespace {
+  typedef int socklen_t;
+
+  bool wouldBlock() {
+    return ::WSAGetLastError() == WSAEWOULDBLOCK;
+  }
+  bool connectInProgress() {
+    return ::WSAGetLastError() == WSAEWOULDBLOCK;
+  }
+  // The client gave up before we accepted it
+  bool acceptAborted() {
+    return ::WSAGetLastError() == WSAECONNRESET;
+  }
+  bool setNonBlocking(SOCKET s) {
+    u_long on = 1;
+    return ::ioctlsocket(s, FIONBIO, &on) == 0;
+  }
+  void closeSocket(SOCKET s) {
+    ::closesocket(s);
+  }
+  // Winsock must be started before any other call
+  void startNet() {
+    static bool started = false;
+    if (started)
+      return;
+    WSADATA data;
+    ::WSAStartup(MAKEWORD(2, 2), &data);
+    started = true;
+  }
+}
+
+const Coroutines::TFd Coroutines::TSocket::invalid_fd = INVALID_SOCKET;
+
+#else
+
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+  bool wouldBlock() {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  bool connectInProgress() {
+    return errno == EINPROGRESS;
+  }
+  // The client gave up before we accepted it. Linux also reports here the
+  // network errors already pending in the new socket
+  bool acceptAborted() {
+    switch (errno) {
+    case ECONNABORTED:
+    case EPROTO:
+#ifdef __linux__
+    case ENETDOWN:
+    case ENOPROTOOPT:
+    case EHOSTDOWN:
+    case ENONET:
+    case EHOSTUNREACH:
+    case EOPNOTSUPP:
+    case ENETUNREACH:
+#endif
+      return true;
+    default:
+      return false;
+    }
+  }
+  bool setNonBlocking(int s) {
+    int flags = ::fcntl(s, F_GETFL, 0);
+    return flags >= 0 && ::fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+  }
+  void closeSocket(int s) {
+    ::close(s);
+  }
+  void startNet() {
+  }
+}
+
+const Coroutines::TFd Coroutines::TSocket::invalid_fd = -1;
+
+#endif
+
+// Linux can create them already non-blocking, saving a syscall per connection
+#ifdef __linux__
+  #define CORO_SOCK_NONBLOCK  SOCK_NONBLOCK
+#else
+  #define CORO_SOCK_NONBLOCK  0
+#endif
+
+namespace Coroutines {
+
+  namespace {
+    // Small messages go out without waiting for the ack of the previous ones
+    void setNoDelay(TFd s) {
+      int on = 1;
+      ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&on, sizeof(on));
+    }
+
+    // recv/send take an int in win32, and we return one. Bigger buffers
+    // are transferred in several calls
+    int clampLen(size_t len) {
+      return (int)(len > INT_MAX ? INT_MAX : len);
+    }
+  }
+
+  // ----------------------------------------------------------
+  TSocket& TSocket::operator=(TSocket&& other) {
+    if (this != &other) {
+      close();
+      fd = other.fd;
+      other.fd = invalid_fd;
+    }
+    return *this;
+  }
+
+  void TSocket::close() {
+    if (fd == invalid_fd)
+      return;
+    forgetFd(fd);
+    closeSocket(fd);
+    fd = invalid_fd;
+  }
+
+  // ----------------------------------------------------------
+  bool TSocket::connect(const char* host, int port, TTimeDelta timeout) {
+    assert(host);
+    startNet();
+    close();
+
+    struct addrinfo hints;
+    memset(&hints, 0x00, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    struct addrinfo* addrs = nullptr;
+    if (::getaddrinfo(host, port_str, &hints, &addrs) != 0)
+      return false;
+
+    for (auto ai = addrs; ai && fd == invalid_fd; ai = ai->ai_next) {
+      TFd s = ::socket(ai->ai_family, ai->ai_socktype | CORO_SOCK_NONBLOCK, ai->ai_protocol);
+      if (s == invalid_fd)
+        continue;
+      if (!CORO_SOCK_NONBLOCK && !setNonBlocking(s)) {
+        closeSocket(s);
+        continue;
+      }
+      int rc = ::connect(s, ai->ai_addr, (socklen_t)ai->ai_addrlen);
+      if (rc != 0 && connectInProgress()) {
+        // The connection has been established, or has failed, when it's writable
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (waitWritable(s, timeout) && ::getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&err, &err_len) == 0 && err == 0)
+          rc = 0;
+      }
+      if (rc != 0) {
+        forgetFd(s);
+        closeSocket(s);
+        continue;
+      }
+      setNoDelay(s);
+      fd = s;
+    }
+    ::freeaddrinfo(addrs);
+    return fd != invalid_fd;
+  }
+
+  // ----------------------------------------------------------
+  // Try first, most of the times there is data already, and wait only if not
+  int TSocket::read(void* buf, size_t len, TTimeDelta timeout) {
+    assert(isValid());
+    while (true) {
+      int n = (int)::recv(fd, (char*)buf, clampLen(len), 0);
+      if (n >= 0)
+        return n;
+      if (!wouldBlock())
+        return -1;
+      if (!waitReadable(fd, timeout))
+        return -1;
+    }
+  }
+
+  int TSocket::write(const void* buf, size_t len, TTimeDelta timeout) {
+    assert(isValid());
+    while (true) {
+#ifdef MSG_NOSIGNAL
+      int n = (int)::send(fd, (const char*)buf, clampLen(len), MSG_NOSIGNAL);
+#else
+      int n = (int)::send(fd, (const char*)buf, clampLen(len), 0);
+#endif
+      if (n >= 0)
+        return n;
+      if (!wouldBlock())
+        return -1;
+      if (!waitWritable(fd, timeout))
+        return -1;
+    }
+  }
+
+  bool TSocket::readExactly(void* buf, size_t len, TTimeDelta timeout) {
+    auto p = (char*)buf;
+    while (len > 0) {
+      int n = read(p, len, timeout);
+      if (n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  bool TSocket::writeAll(const void* buf, size_t len, TTimeDelta timeout) {
+    auto p = (const char*)buf;
+    while (len > 0) {
+      int n = write(p, len, timeout);
+      if (n <= 0)
+        return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // ----------------------------------------------------------
+  bool TListener::listen(const char* ip, int port, int backlog) {
+    assert(ip);
+    startNet();
+    close();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0x00, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    if (::inet_pton(AF_INET, ip, &addr.sin_addr) != 1)
+      return false;
+
+    TFd s = ::socket(AF_INET, SOCK_STREAM | CORO_SOCK_NONBLOCK, 0);
+    if (s == TSocket::invalid_fd)
+      return false;
+    int on = 1;
+    ::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+    if ((!CORO_SOCK_NONBLOCK && !setNonBlocking(s))
+      || ::bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || ::listen(s, backlog) != 0) {
+      closeSocket(s);
+      return false;
+    }
+    fd = s;
+    return true;
+  }
+
+  bool TListener::accept(TSocket& new_socket, TTimeDelta timeout) {
+    assert(fd != TSocket::invalid_fd);
+    while (true) {
+#ifdef __linux__
+      TFd s = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK);
+#else
+      TFd s = ::accept(fd, nullptr, nullptr);
+#endif
+      if (s != TSocket::invalid_fd) {
+        if (!CORO_SOCK_NONBLOCK)
+          setNonBlocking(s);
+        setNoDelay(s);
+        new_socket = TSocket(s);
+        return true;
+      }
+      if (acceptAborted())
+        continue;
+      if (!wouldBlock())
+        return false;
+      if (!waitReadable(fd, timeout))
+        return false;
+    }
+  }
+
+  void TListener::close() {
+    if (fd == TSocket::invalid_fd)
+      return;
+    forgetFd(fd);
+    closeSocket(fd);
+    fd = TSocket::invalid_fd;
+  }
+
+  int TListener::port() const {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (::getsockname(fd, (struct sockaddr*)&addr, &len) != 0)
+      return -1;
+    return ntohs(addr.sin_port);
+  }
+
+}
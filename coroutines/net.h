@@ -0,0 +1,63 @@
+#ifndef INC_COROUTINES_NET_H_
+#define INC_COROUTINES_NET_H_
+
+#include <cstddef>
+#include "io.h"
+
+namespace Coroutines {
+
+  // ----------------------------------------
+  // A TCP connection. The sockets are non-blocking, and when they are not
+  // ready the calling coroutine waits for them, not the thread.
+  // Timeouts are for each call, not for the whole transfer
+  class TSocket {
+    TFd fd;
+
+  public:
+    static const TFd invalid_fd;
+
+    TSocket() : fd(invalid_fd) { }
+    explicit TSocket(TFd new_fd) : fd(new_fd) { }
+    ~TSocket() { close(); }
+    TSocket(TSocket&& other) : fd(other.fd) { other.fd = invalid_fd; }
+    TSocket& operator=(TSocket&& other);
+    TSocket(const TSocket&) = delete;
+    TSocket& operator=(const TSocket&) = delete;
+
+    // host can be a name or a numeric address. Resolving names blocks the thread
+    bool connect(const char* host, int port, TTimeDelta timeout = io_no_timeout);
+    // Return the bytes transferred, 0 when the peer has closed the connection,
+    // and -1 on errors or timeout. At most 2 GB per call
+    int  read(void* buf, size_t len, TTimeDelta timeout = io_no_timeout);
+    int  write(const void* buf, size_t len, TTimeDelta timeout = io_no_timeout);
+    // False if the connection is closed or fails before all the bytes are transferred
+    bool readExactly(void* buf, size_t len, TTimeDelta timeout = io_no_timeout);
+    bool writeAll(const void* buf, size_t len, TTimeDelta timeout = io_no_timeout);
+    void close();
+    bool isValid() const { return fd != invalid_fd; }
+    TFd  handle() const { return fd; }
+  };
+
+  // ----------------------------------------
+  class TListener {
+    TFd fd;
+
+  public:
+    TListener() : fd(TSocket::invalid_fd) { }
+    ~TListener() { close(); }
+    TListener(const TListener&) = delete;
+    TListener& operator=(const TListener&) = delete;
+
+    // ip is a numeric address, port 0 lets the system choose one
+    bool listen(const char* ip, int port, int backlog = 1024);
+    // Waits for a new connection. False on errors or timeout. The connections
+    // reset by the client before being accepted are skipped
+    bool accept(TSocket& new_socket, TTimeDelta timeout = io_no_timeout);
+    void close();
+    // The port bound
+    int  port() const;
+  };
+
+}
+
+#endif
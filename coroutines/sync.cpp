@@ -0,0 +1,75 @@
+#include "sync.h"
+
+namespace Coroutines {
+
+  // The waiters register with the scheduler lock taken, which the releasing
+  // side also takes before looking at them. The releasing side only checks
+  // nwaiters after updating the count, and the waiters check the count again
+  // after increasing nwaiters, so one of both sees the other.
+
+  // ----------------------------------------------------------
+  void TMutex::lockSlow() {
+    assert(internal::inCoroutine());
+    internal::TScopedLock lock;
+    while (true) {
+      int s = state.load();
+      if (s == 0) {
+        if (state.compare_exchange_strong(s, released.waiters.empty() ? 1 : 2))
+          return;
+        continue;
+      }
+      if (s == 1 && !state.compare_exchange_strong(s, 2))
+        continue;
+      // unlock will see the 2, and give us the mutex
+      released.wait();
+      return;
+    }
+  }
+
+  void TMutex::unlockSlow() {
+    internal::TScopedLock lock;
+    assert(state.load() == 2);
+    if (released.waiters.empty()) {
+      state.store(0);
+      return;
+    }
+    // Still taken, now by the first waiter
+    released.notifyOne();
+    if (released.waiters.empty())
+      state.store(1);
+  }
+
+  // ----------------------------------------------------------
+  void TSemaphore::acquireSlow() {
+    assert(internal::inCoroutine());
+    internal::TScopedLock lock;
+    nwaiters.fetch_add(1);
+    if (tryAcquire()) {
+      nwaiters.fetch_sub(1);
+      return;
+    }
+    // releaseSlow takes the unit for us before waking us up
+    released.wait();
+  }
+
+  void TSemaphore::releaseSlow() {
+    internal::TScopedLock lock;
+    while (!released.waiters.empty() && tryAcquire()) {
+      nwaiters.fetch_sub(1);
+      released.notifyOne();
+    }
+  }
+
+  // ----------------------------------------------------------
+  bool TWaitGroup::wait(TTimeDelta timeout) {
+    if (counter.load() == 0)
+      return true;
+    assert(internal::inCoroutine());
+    internal::TScopedLock lock;
+    nwaiters.fetch_add(1);
+    bool ok = counter.load() == 0 || finished.wait(timeout);
+    nwaiters.fetch_sub(1);
+    return ok;
+  }
+
+}
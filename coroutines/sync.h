@@ -0,0 +1,109 @@
+#ifndef INC_COROUTINES_SYNC_H_
+#define INC_COROUTINES_SYNC_H_
+
+#include <atomic>
+#include "coroutines.h"
+#include "event.h"
+
+namespace Coroutines {
+
+  // ----------------------------------------
+  // While there is no contention, these only use atomics and never take the
+  // scheduler lock. Coroutines which have to wait are parked in the list of
+  // a TEvent, and woken up in FIFO order. Waiting must be done from a
+  // coroutine, releasing can be done from any thread with runWorkers.
+
+  // ----------------------------------------
+  // Not recursive. Works with std::lock_guard. unlock gives the mutex to the
+  // first coroutine waiting, so it can't be taken again by the one unlocking
+  class TMutex {
+    std::atomic<int> state;       // 0 free, 1 taken, 2 taken and maybe waiters
+    TEvent           released;
+
+    void lockSlow();
+    void unlockSlow();
+
+  public:
+    TMutex() : state(0) { }
+    TMutex(const TMutex&) = delete;
+    TMutex& operator=(const TMutex&) = delete;
+
+    bool tryLock() {
+      int expected = 0;
+      return state.compare_exchange_strong(expected, 1);
+    }
+    void lock() {
+      if (!tryLock())
+        lockSlow();
+    }
+    void unlock() {
+      int expected = 1;
+      if (!state.compare_exchange_strong(expected, 0))
+        unlockSlow();
+    }
+  };
+
+  // ----------------------------------------
+  // Counting semaphore. A release goes to the first coroutine waiting
+  class TSemaphore {
+    std::atomic<int> count;
+    std::atomic<int> nwaiters;
+    TEvent           released;
+
+    void acquireSlow();
+    void releaseSlow();
+
+  public:
+    explicit TSemaphore(int initial_count = 0) : count(initial_count), nwaiters(0) { }
+    TSemaphore(const TSemaphore&) = delete;
+    TSemaphore& operator=(const TSemaphore&) = delete;
+
+    bool tryAcquire() {
+      int c = count.load();
+      while (c > 0) {
+        if (count.compare_exchange_weak(c, c - 1))
+          return true;
+      }
+      return false;
+    }
+    void acquire() {
+      if (!tryAcquire())
+        acquireSlow();
+    }
+    void release(int n = 1) {
+      assert(n > 0);
+      count.fetch_add(n);
+      if (nwaiters.load() > 0)
+        releaseSlow();
+    }
+  };
+
+  // ----------------------------------------
+  // add before starting the work, done when each part finishes, and wait
+  // until all of them have
+  class TWaitGroup {
+    std::atomic<int> counter;
+    std::atomic<int> nwaiters;
+    TEvent           finished;
+
+  public:
+    TWaitGroup() : counter(0), nwaiters(0) { }
+    TWaitGroup(const TWaitGroup&) = delete;
+    TWaitGroup& operator=(const TWaitGroup&) = delete;
+
+    void add(int n = 1) {
+      counter.fetch_add(n);
+    }
+    void done() {
+      int prev = counter.fetch_sub(1);
+      assert(prev > 0);
+      if (prev == 1 && nwaiters.load() > 0)
+        finished.notifyAll();
+    }
+    // Returns false if the timeout expires first
+    bool wait(TTimeDelta timeout = no_timeout);
+  };
+
+}
+
+#endif
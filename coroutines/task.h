@@ -0,0 +1,341 @@
+#ifndef INC_COROUTINES_TASK_H_
+#define INC_COROUTINES_TASK_H_
+
+// Stackless coroutines. They need a compiler with C++20 coroutines, so with
+// the others this header is empty
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include "coroutines.h"
+#include "channel.h"
+
+namespace Coroutines {
+
+  // ----------------------------------------
+  // A stackless coroutine, any function returning a TTask and using co_await
+  // or co_return. It only costs its frame, allocated by the compiler, and a
+  // slot in the coroutines table, but it can only suspend in its own body,
+  // with co_await, never in the functions it calls. So it can't use wait(),
+  // yield() or the blocking push/pull, but their versions below.
+  //
+  // It does nothing until it's given to spawn(), which makes it ready like
+  // start() does, and then it has a THandle like any other coroutine. The
+  // scheduler runs it in its own stack. A task can also co_await another
+  // TTask, which then runs inside the first one, like a function call, and
+  // returns its co_return value.
+  template< typename T = void >
+  class TTask;
+
+  namespace internal {
+
+    static void resumeFrame(void* frame) {
+      std::coroutine_handle<>::from_address(frame).resume();
+    }
+
+    struct TTaskPromiseBase {
+      std::coroutine_handle<> awaiting;     // The task awaiting us, null if spawned
+
+      // Back to the one awaiting us. If we were spawned, nobody reads our
+      // value, so the frame goes away now
+      struct TFinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template< typename TPromise >
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<TPromise> frame) noexcept {
+          auto next = frame.promise().awaiting;
+          if (next)
+            return next;
+          endStackless();
+          frame.destroy();
+          return std::noop_coroutine();
+        }
+        void await_resume() noexcept { }
+      };
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      TFinalAwaiter final_suspend() noexcept { return {}; }
+      void unhandled_exception() { std::terminate(); }
+    };
+
+    template< typename T >
+    struct TTaskPromise : public TTaskPromiseBase {
+      std::optional<T> value;
+      TTask<T> get_return_object();
+      template< typename U >
+      void return_value(U&& new_value) { value.emplace(std::forward<U>(new_value)); }
+      T takeValue() { return std::move(*value); }
+    };
+
+    template<>
+    struct TTaskPromise<void> : public TTaskPromiseBase {
+      TTask<void> get_return_object();
+      void return_void() { }
+      void takeValue() { }
+    };
+  }
+
+  // ----------------------------------------
+  template< typename T >
+  class TTask {
+  public:
+    typedef internal::TTaskPromise<T> promise_type;
+
+  private:
+    typedef std::coroutine_handle<promise_type> TFrame;
+    TFrame frame;
+
+    friend struct internal::TTaskPromise<T>;
+    template< typename U >
+    friend THandle spawn(TTask<U> task);
+
+    explicit TTask(TFrame new_frame) : frame(new_frame) { }
+
+    struct TAwaiter {
+      TFrame frame;
+      bool await_ready() { return frame.done(); }
+      // Runs it now, without going through the scheduler
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        frame.promise().awaiting = awaiting;
+        return frame;
+      }
+      T await_resume() { return frame.promise().takeValue(); }
+    };
+
+  public:
+    TTask() { }
+    TTask(TTask&& other) : frame(other.frame) { other.frame = nullptr; }
+    TTask& operator=(TTask&& other) {
+      if (this != &other) {
+        if (frame)
+          frame.destroy();
+        frame = other.frame;
+        other.frame = nullptr;
+      }
+      return *this;
+    }
+    TTask(const TTask&) = delete;
+    TTask& operator=(const TTask&) = delete;
+    ~TTask() {
+      if (frame)
+        frame.destroy();
+    }
+
+    TAwaiter operator co_await() {
+      assert(frame);
+      return TAwaiter{ frame };
+    }
+  };
+
+  template< typename T >
+  TTask<T> internal::TTaskPromise<T>::get_return_object() {
+    return TTask<T>(std::coroutine_handle<TTaskPromise<T>>::from_promise(*this));
+  }
+
+  inline TTask<void> internal::TTaskPromise<void>::get_return_object() {
+    return TTask<void>(std::coroutine_handle<TTaskPromise<void>>::from_promise(*this));
+  }
+
+  // --------------------------
+  // The scheduler runs the task once it gets to it, and destroys it when it
+  // has finished. Its value, if any, is discarded
+  template< typename T >
+  THandle spawn(TTask<T> task) {
+    assert(task.frame && !task.frame.done());
+    void* frame = task.frame.address();
+    task.frame = nullptr;
+    return internal::startStackless(&internal::resumeFrame, frame);
+  }
+
+  namespace internal {
+
+    // ----------------------------------------
+    // Waits like wait(), with the lock taken from the check until it's woken
+    // up. The scheduler releases it once the task has returned to it, and
+    // takes it again before resuming it
+    class TEventsAwaiter {
+      TWatchedEvent* watched_events;
+      int            nwatched_events;
+      TTimeDelta     timeout;
+      TWatchedEvent  time_we;
+      int            event_idx;
+
+    public:
+      TEventsAwaiter(TWatchedEvent* new_watched_events, int new_nwatched_events, TTimeDelta new_timeout)
+        : watched_events(new_watched_events), nwatched_events(new_nwatched_events), timeout(new_timeout), event_idx(0) { }
+      TEventsAwaiter(const TEventsAwaiter&) = delete;
+      TEventsAwaiter& operator=(const TEventsAwaiter&) = delete;
+
+      bool await_ready() {
+        lock();
+        event_idx = beginWait(watched_events, nwatched_events, timeout, &time_we);
+        if (event_idx == wait_must_suspend)
+          return false;
+        unlock();
+        return true;
+      }
+      void await_suspend(std::coroutine_handle<> frame) {
+        suspendStackless(&resumeFrame, frame.address());
+      }
+      int await_resume() {
+        if (event_idx == wait_must_suspend) {
+          event_idx = endWait(watched_events, nwatched_events, timeout, &time_we);
+          unlock();
+        }
+        return event_idx;
+      }
+    };
+
+    class TEndAwaiter : public TEventsAwaiter {
+      TWatchedEvent we;
+    public:
+      TEndAwaiter(THandle h, TTimeDelta timeout) : TEventsAwaiter(&we, 1, timeout), we(h) { }
+      bool await_resume() { return TEventsAwaiter::await_resume() != wait_timedout; }
+    };
+
+    // ----------------------------------------
+    // The steps of push/pull on a TChannel. Each time it's woken up, the
+    // scheduler calls resume, which tries again, and only resumes the task
+    // once it's done. TOp::attempt returns true when done, or false once
+    // it's waiting for evt, with the lock taken
+    template< typename TOp >
+    class TChannelAwaiter {
+    protected:
+      TChannel*               ch;
+      TWatchedEvent           evt;
+      std::coroutine_handle<> frame;
+      bool                    result;
+
+      bool mustSuspend() {
+        return beginWait(&evt, 1, no_timeout, nullptr) == wait_must_suspend;
+      }
+      bool done(bool new_result) {
+        result = new_result;
+        return true;
+      }
+
+      static void resume(void* context) {
+        auto op = static_cast<TOp*>(context);
+        endWait(&op->evt, 1, no_timeout, nullptr);
+        if (op->evt.channel.handed_off)
+          op->result = true;
+        else if (!op->attempt())
+          return;
+        op->frame.resume();
+      }
+
+    public:
+      explicit TChannelAwaiter(TChannel* new_ch) : ch(new_ch), result(false) {
+        assert(ch);
+      }
+      TChannelAwaiter(const TChannelAwaiter&) = delete;
+      TChannelAwaiter& operator=(const TChannelAwaiter&) = delete;
+
+      bool await_ready() {
+        lock();
+        if (!static_cast<TOp*>(this)->attempt())
+          return false;
+        unlock();
+        return true;
+      }
+      void await_suspend(std::coroutine_handle<> new_frame) {
+        frame = new_frame;
+        suspendStackless(&resume, static_cast<TOp*>(this));
+      }
+      bool await_resume() {
+        if (frame)
+          unlock();
+        return result;
+      }
+    };
+
+    template< typename TObj >
+    class TPullAwaiter : public TChannelAwaiter< TPullAwaiter<TObj> > {
+      friend class TChannelAwaiter< TPullAwaiter<TObj> >;
+      TObj* obj;
+
+      bool attempt() {
+        auto ch = this->ch;
+        while (!ch->canPull()) {
+          if (ch->pullFromWaiter(obj, sizeof(TObj)))
+            return this->done(true);
+          if (ch->closed() && ch->empty())
+            return this->done(false);
+          this->evt = TWatchedEvent(ch, *obj, EVT_CHANNEL_CAN_PULL);
+          this->evt.channel.handoff = true;
+          if (this->mustSuspend())
+            return false;
+        }
+        ch->pull(obj, sizeof(TObj));
+        return this->done(true);
+      }
+
+    public:
+      TPullAwaiter(TChannel* new_ch, TObj& new_obj) : TChannelAwaiter< TPullAwaiter<TObj> >(new_ch), obj(&new_obj) { }
+    };
+
+    template< typename TObj >
+    class TPushAwaiter : public TChannelAwaiter< TPushAwaiter<TObj> > {
+      friend class TChannelAwaiter< TPushAwaiter<TObj> >;
+      const TObj* obj;
+
+      bool attempt() {
+        auto ch = this->ch;
+        while (!ch->closed()) {
+          if (ch->pushToWaiter(obj, sizeof(TObj)))
+            return this->done(true);
+          if (ch->canPush()) {
+            ch->push(obj, sizeof(TObj));
+            return this->done(true);
+          }
+          this->evt = TWatchedEvent(ch, *obj, EVT_CHANNEL_CAN_PUSH);
+          this->evt.channel.handoff = true;
+          if (this->mustSuspend())
+            return false;
+        }
+        return this->done(false);
+      }
+
+    public:
+      TPushAwaiter(TChannel* new_ch, const TObj& new_obj) : TChannelAwaiter< TPushAwaiter<TObj> >(new_ch), obj(&new_obj) { }
+    };
+  }
+
+  // ----------------------------------------
+  // What a task can co_await, besides another TTask. Each one mirrors the
+  // blocking version, and returns the same
+
+  // wait(watched_events, nwatched_events, timeout). The events must be
+  // created inside the task, as they take their owner from current()
+  inline internal::TEventsAwaiter awaitEvents(TWatchedEvent* watched_events, int nwatched_events, TTimeDelta timeout = no_timeout) {
+    return internal::TEventsAwaiter(watched_events, nwatched_events, timeout);
+  }
+
+  // Suspends the task for the given time
+  inline internal::TEventsAwaiter awaitTimeout(TTimeDelta timeout) {
+    return internal::TEventsAwaiter(nullptr, 0, timeout);
+  }
+
+  // Until the coroutine h, stackless or not, has finished. False if the
+  // timeout expires first
+  inline internal::TEndAwaiter awaitEnd(THandle h, TTimeDelta timeout = no_timeout) {
+    return internal::TEndAwaiter(h, timeout);
+  }
+
+  // pull(ch, obj) and push(ch, obj)
+  template< typename TObj >
+  internal::TPullAwaiter<TObj> awaitPull(TChannel* ch, TObj& obj) {
+    return internal::TPullAwaiter<TObj>(ch, obj);
+  }
+
+  template< typename TObj >
+  internal::TPushAwaiter<TObj> awaitPush(TChannel* ch, const TObj& obj) {
+    return internal::TPushAwaiter<TObj>(ch, obj);
+  }
+
+}
+
+#endif
+
+#endif
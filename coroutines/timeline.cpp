@@ -1,41 +1,276 @@
 #include "timeline.h"
 #include "coroutines.h"
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <time.h>
+#include <errno.h>
+#endif
+
 namespace Coroutines {
   
   void wakeUp(TWatchedEvent* we);
 
-
   TTimeStamp current_timestamp;
-  TList      waiting_for_timeouts;
+  eClockMode clock_mode = CLOCK_MODE_TICKS;
+
+  // --------------------------------------------------------------
+  // Hierarchical timing wheel. Level L has 64 slots of 64^L ticks each,
+  // and 11 levels cover the whole 64 bits range.
+  // A timeout lives in the level of the highest 6-bit group where its
+  // trigger time differs from the wheel time, so inserting and cancelling
+  // are O(1). When the wheel time enters a slot of an upper level, the
+  // timeouts in it are moved down, and the ones in the level 0 slot of
+  // the current time fire. Ticks where nothing can happen are skipped.
+  // In CLOCK_MODE_MONOTONIC mode a wheel tick is 2^16 ns, about 65 us.
+  namespace {
+
+    const int      slot_bits = 6;
+    const int      nslots = 1 << slot_bits;
+    const uint64_t slot_mask = nslots - 1;
+    const int      nlevels = (64 + slot_bits - 1) / slot_bits;
+
+    TList          slots[nlevels][nslots];
+    uint64_t       occupied[nlevels];              // One bit per non empty slot
+    TList          expired;                        // Already expired when registered
+    TTimeStamp     wheel_time = 0;                 // Everything up to here has fired
+    int            wheel_shift = 0;                // From timestamps to wheel ticks
+
+    // Timeouts never fire before their time
+    TTimeStamp wheelTickOf(TTimeStamp t) {
+      return (t >> wheel_shift) + ((t & ((1ull << wheel_shift) - 1)) ? 1 : 0);
+    }
+
+    int levelOf(uint64_t diff_bits) {
+      int level = 0;
+      while (diff_bits >> slot_bits) {
+        diff_bits >>= slot_bits;
+        ++level;
+      }
+      return level;
+    }
+
+    int firstSlotAfter(uint64_t mask, int idx) {
+      uint64_t after = (idx + 1 < nslots) ? (mask & (~0ull << (idx + 1))) : 0;
+      if (!after)
+        return -1;
+      int n = 0;
+      while (!(after & 1)) {
+        after >>= 1;
+        ++n;
+      }
+      return n;
+    }
+
+    void insert(TWatchedEvent* we) {
+      TTimeStamp t = wheelTickOf(we->time.time_to_trigger);
+      uint64_t diff_bits = t ^ wheel_time;
+      if (t <= wheel_time) {
+        // Fire in the next update
+        we->time.slot = &expired;
+      }
+      else {
+        int level = levelOf(diff_bits);
+        int idx = (int)((t >> (level * slot_bits)) & slot_mask);
+        we->time.slot = &slots[level][idx];
+        occupied[level] |= 1ull << idx;
+      }
+      we->time.slot->append(we);
+    }
+
+    void remove(TWatchedEvent* we) {
+      TList* slot = we->time.slot;
+      assert(slot);
+      slot->detach(we);
+      we->time.slot = nullptr;
+      if (slot != &expired && slot->empty()) {
+        int n = (int)(slot - &slots[0][0]);
+        occupied[n / nslots] &= ~(1ull << (n % nslots));
+      }
+    }
+
+    // Move down all the timeouts in the slot. They are now closer to the wheel time
+    void cascade(TList* slot) {
+      TList pending = *slot;
+      *slot = TList();
+      int n = (int)(slot - &slots[0][0]);
+      occupied[n / nslots] &= ~(1ull << (n % nslots));
+      while (auto we = pending.detachFirst< TWatchedEvent >())
+        insert(we);
+    }
+
+    // Next tick where the wheel has something to do, and the slot that
+    // holds it. Returns 0 if the wheel is empty
+    TTimeStamp nextWheelTick(TList** next_slot = nullptr) {
+      TTimeStamp next = 0;
+      for (int level = 0; level < nlevels; ++level) {
+        if (!occupied[level])
+          continue;
+        int shift = level * slot_bits;
+        int idx = firstSlotAfter(occupied[level], (int)((wheel_time >> shift) & slot_mask));
+        assert(idx >= 0);
+        int block_shift = shift + slot_bits;
+        TTimeStamp block = (block_shift < 64) ? ((wheel_time >> block_shift) << block_shift) : 0;
+        TTimeStamp t = block | ((TTimeStamp)idx << shift);
+        if (!next || t < next) {
+          next = t;
+          if (next_slot)
+            *next_slot = &slots[level][idx];
+        }
+      }
+      return next;
+    }
+
+    void fire(TList* slot) {
+      while (!slot->empty()) {
+        auto we = static_cast<TWatchedEvent*>(slot->first);
+        assert(we->time.time_to_trigger <= current_timestamp);
+        remove(we);
+        wakeUp(we);
+      }
+    }
 
+    void advanceWheel(TTimeStamp target) {
+      fire(&expired);
+      while (wheel_time < target) {
+        TTimeStamp next = nextWheelTick();
+        if (!next || next > target) {
+          wheel_time = target;
+          break;
+        }
+        wheel_time = next;
+
+        // Entering new slots in the upper levels, top to bottom
+        for (int level = nlevels - 1; level > 0; --level) {
+          int shift = level * slot_bits;
+          if (wheel_time & ((1ull << shift) - 1))
+            continue;
+          cascade(&slots[level][(wheel_time >> shift) & slot_mask]);
+        }
+
+        // Fire the ones in the current tick, cascade leaves some in expired
+        fire(&expired);
+        fire(&slots[0][wheel_time & slot_mask]);
+      }
+    }
+
+  }
+
+  // --------------------------------------------------------------
+#ifdef _WIN32
+  static TTimeStamp clockNow() {
+    static LARGE_INTEGER freq = { 0 };
+    if (!freq.QuadPart)
+      ::QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER counter;
+    ::QueryPerformanceCounter(&counter);
+    uint64_t secs = counter.QuadPart / freq.QuadPart;
+    uint64_t rest = counter.QuadPart % freq.QuadPart;
+    return secs * 1000000000ull + rest * 1000000000ull / freq.QuadPart;
+  }
+#else
+  static TTimeStamp clockNow() {
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TTimeStamp)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+#endif
+
+  static TTimeStamp clock_base = 0;
+
+  // --------------------------------------------------------------
   TTimeStamp now() {
     return current_timestamp;
   }
 
+  void setClockMode(eClockMode new_mode) {
+    clock_mode = new_mode;
+    wheel_shift = (new_mode == CLOCK_MODE_MONOTONIC) ? 16 : 0;
+    resetTimer();
+  }
+
+  eClockMode clockMode() {
+    return clock_mode;
+  }
+
   void resetTimer() {
+    // Pending timeouts keep their trigger time, but must be placed again
+    TList pending;
+    for (int level = 0; level < nlevels; ++level) {
+      for (int idx = 0; idx < nslots; ++idx) {
+        while (auto we = slots[level][idx].detachFirst< TWatchedEvent >())
+          pending.append(we);
+      }
+      occupied[level] = 0;
+    }
+    while (auto we = expired.detachFirst< TWatchedEvent >())
+      pending.append(we);
     current_timestamp = 0;
+    wheel_time = 0;
+    clock_base = clockNow();
+    while (auto we = pending.detachFirst< TWatchedEvent >())
+      insert(we);
   }
 
   void updateCurrentTime(TTimeDelta delta_ticks) {
-    current_timestamp += delta_ticks;
-    auto we = static_cast<TWatchedEvent*>( waiting_for_timeouts.first );
+    if (clock_mode == CLOCK_MODE_MONOTONIC)
+      current_timestamp = clockNow() - clock_base;
+    else
+      current_timestamp += delta_ticks;
+    advanceWheel(current_timestamp >> wheel_shift);
+  }
+
+  bool nextTimeout(TTimeStamp& when) {
+    if (!expired.empty()) {
+      when = current_timestamp;
+      return true;
+    }
+    TList* slot = nullptr;
+    if (!nextWheelTick(&slot))
+      return false;
+    // The earliest timeout is in that slot, but a slot of the upper
+    // levels covers several ticks, so we must look for it
+    auto we = static_cast<TWatchedEvent*>(slot->first);
+    assert(we);
+    when = we->time.time_to_trigger;
     while (we) {
-      assert(we->event_type == EVT_TIMEOUT);
-      if (we->time.time_to_trigger <= current_timestamp)
-        wakeUp( we );
+      if (we->time.time_to_trigger < when)
+        when = we->time.time_to_trigger;
       we = static_cast<TWatchedEvent*>(we->next);
     }
+    // It will fire when the wheel reaches its tick
+    when = wheelTickOf(when) << wheel_shift;
+    return true;
+  }
+
+  void sleepUntil(TTimeStamp when) {
+    assert(clock_mode == CLOCK_MODE_MONOTONIC);
+    TTimeStamp abs_time = clock_base + when;
+#ifdef _WIN32
+    TTimeStamp clock_now = clockNow();
+    if (abs_time > clock_now)
+      ::Sleep((DWORD)((abs_time - clock_now + 999999) / 1000000));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)(abs_time / 1000000000ull);
+    ts.tv_nsec = (long)(abs_time % 1000000000ull);
+    while (::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+#endif
   }
 
   void registerTimeoutEvent(TWatchedEvent* we) {
     assert(we->event_type == EVT_TIMEOUT);
-    waiting_for_timeouts.append(we);
+    assert(we->time.slot == nullptr);
+    insert(we);
   }
 
   void unregisterTimeoutEvent(TWatchedEvent* we) {
     assert(we->event_type == EVT_TIMEOUT);
-    waiting_for_timeouts.detach(we);
+    // It's not in the wheel once it has fired
+    if (we->time.slot)
+      remove(we);
   }
 
 }
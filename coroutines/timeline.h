@@ -11,11 +11,31 @@ namespace Coroutines {
 
   struct TWatchedEvent;
 
+  enum eClockMode {
+    CLOCK_MODE_TICKS        // Time only moves when the host calls updateCurrentTime(delta_ticks)
+  , CLOCK_MODE_MONOTONIC    // Time is read from the monotonic clock, in nanoseconds
+  , CLOCK_MODE_VIRTUAL      // Like ticks, but run() jumps to the next timeout when nothing is ready
+  };
+
+  // In CLOCK_MODE_MONOTONIC mode, time deltas are in nanoseconds
+  inline TTimeDelta microseconds(uint64_t n) { return n * 1000ull; }
+  inline TTimeDelta milliseconds(uint64_t n) { return n * 1000000ull; }
+  inline TTimeDelta seconds(uint64_t n) { return n * 1000000000ull; }
+
+  // Changing the mode resets the timer
+  void setClockMode(eClockMode new_mode);
+  eClockMode clockMode();
+
   TTimeStamp now();
   void resetTimer();
+  // In CLOCK_MODE_MONOTONIC mode the delta is ignored, and time is read from the clock
   void updateCurrentTime(TTimeDelta delta_ticks);
   void registerTimeoutEvent(TWatchedEvent* we);
   void unregisterTimeoutEvent(TWatchedEvent* we);
+  // When the earliest of the registered timeouts will fire. False if there is none
+  bool nextTimeout(TTimeStamp& when);
+  // Blocks the thread. Only in CLOCK_MODE_MONOTONIC mode
+  void sleepUntil(TTimeStamp when);
 
 }
 
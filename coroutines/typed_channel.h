@@ -0,0 +1,136 @@
+#ifndef INC_COROUTINES_TYPED_CHANNEL_H_
+#define INC_COROUTINES_TYPED_CHANNEL_H_
+
+#include <new>
+#include <utility>
+#include "channel.h"
+
+namespace Coroutines {
+
+  // ----------------------------------------
+  // A channel of N items of type T, stored inside the object, so a channel
+  // is a single allocation. The items are moved in and out, so T does not
+  // need to be trivially copyable. N must be a power of two, so the slots
+  // are found with a mask. Waits like TChannel, with the same events
+  template< typename T, size_t N >
+  class TTypedChannel : public TChannelBase {
+    static_assert(N > 0, "TTypedChannel needs room for one item at least");
+    static_assert((N & (N - 1)) == 0, "TTypedChannel size must be a power of two");
+    static const size_t mask = N - 1;
+
+    // sizeof(T) is a multiple of alignof(T), so all of them are aligned
+    alignas(T) unsigned char slots[N][sizeof(T)];
+
+    T* addrOfItem(size_t idx) {
+      return reinterpret_cast<T*>(slots[idx & mask]);
+    }
+
+  public:
+    TTypedChannel() : TChannelBase(N) { }
+    ~TTypedChannel() {
+      while (nelems_stored > 0) {
+        addrOfItem(first_idx)->~T();
+        first_idx = (first_idx + 1) & mask;
+        --nelems_stored;
+      }
+    }
+    TTypedChannel(const TTypedChannel&) = delete;
+    TTypedChannel& operator=(const TTypedChannel&) = delete;
+
+    // There must be room/items. Wake up one waiter of the other side
+    void push(T&& obj) {
+      internal::TScopedLock lock;
+      assert(!full());
+      assert(!closed());
+      new (addrOfItem(first_idx + nelems_stored)) T(std::move(obj));
+      ++nelems_stored;
+      wakeUpN(waiting_for_pull, 1);
+    }
+
+    void pull(T& obj) {
+      internal::TScopedLock lock;
+      assert(!empty());
+      T* item = addrOfItem(first_idx);
+      obj = std::move(*item);
+      item->~T();
+      first_idx = (first_idx + 1) & mask;
+      --nelems_stored;
+
+      // A waiting pusher can leave its item in the slot just freed
+      auto we = waiting_for_push.detachFirst< TWatchedEvent >();
+      if (we) {
+        if (we->channel.handoff && !push_reserved && !closed()) {
+          new (addrOfItem(first_idx + nelems_stored)) T(std::move(*static_cast<T*>(we->channel.data_addr)));
+          ++nelems_stored;
+          we->channel.handed_off = true;
+        }
+        wakeUp(we);
+      }
+    }
+
+    // Move the item directly to/from a coroutine waiting in pull/push
+    bool pushToWaiter(T& obj) {
+      internal::TScopedLock lock;
+      auto we = handOffWaiter(waiting_for_pull);
+      if (!we)
+        return false;
+      *static_cast<T*>(we->channel.data_addr) = std::move(obj);
+      handedOff(waiting_for_pull, we);
+      return true;
+    }
+
+    bool pullFromWaiter(T& obj) {
+      internal::TScopedLock lock;
+      auto we = handOffWaiter(waiting_for_push);
+      if (!we)
+        return false;
+      obj = std::move(*static_cast<T*>(we->channel.data_addr));
+      handedOff(waiting_for_push, we);
+      return true;
+    }
+  };
+
+  // -----------------------------------------------------
+  // Same contract as the TChannel versions
+  template< typename T, size_t N >
+  bool push(TTypedChannel<T, N>* ch, T obj) {
+    assert(ch);
+    internal::TScopedLock lock;
+    while (!ch->closed()) {
+      if (ch->pushToWaiter(obj))
+        return true;
+      if (ch->canPush()) {
+        ch->push(std::move(obj));
+        return true;
+      }
+      TWatchedEvent evt(ch, obj, EVT_CHANNEL_CAN_PUSH);
+      evt.channel.handoff = true;
+      wait(&evt, 1);
+      if (evt.channel.handed_off)
+        return true;
+    }
+    return false;
+  }
+
+  template< typename T, size_t N >
+  bool pull(TTypedChannel<T, N>* ch, T& obj) {
+    assert(ch);
+    internal::TScopedLock lock;
+    while (!ch->canPull()) {
+      if (ch->pullFromWaiter(obj))
+        return true;
+      if (ch->closed() && ch->empty())
+        return false;
+      TWatchedEvent evt(ch, obj, EVT_CHANNEL_CAN_PULL);
+      evt.channel.handoff = true;
+      wait(&evt, 1);
+      if (evt.channel.handed_off)
+        return true;
+    }
+    ch->pull(obj);
+    return true;
+  }
+
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef INC_COROUTINES_TESTS_TEST_H_
+#define INC_COROUTINES_TESTS_TEST_H_
+
+// Each test is a program which returns 0 when all its checks pass
+#include <atomic>
+#include <cstdio>
+
+static std::atomic<int> test_nfailed(0);
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      ++test_nfailed; \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+static int testResult() {
+  if (test_nfailed)
+    printf("%d checks failed\n", test_nfailed.load());
+  else
+    printf("OK\n");
+  return test_nfailed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,102 @@
+// asyncRead/asyncWrite, with the io_uring and with the fallback used
+// when the kernel has none
+#include "coroutines.h"
+#include "test.h"
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace Coroutines;
+
+// Regular files can't be polled, the fallback reads/writes them right away
+static void testFile() {
+  FILE* f = ::tmpfile();
+  CHECK(f);
+  int fd = ::fileno(f);
+  start([fd]() {
+    char out[4096];
+    for (int i = 0; i < 4; ++i) {
+      memset(out, 'a' + i, sizeof(out));
+      CHECK(asyncWrite(fd, out, sizeof(out), i * sizeof(out)) == sizeof(out));
+    }
+    char in[4096];
+    for (int i = 3; i >= 0; --i) {
+      CHECK(asyncRead(fd, in, sizeof(in), i * sizeof(in)) == sizeof(in));
+      CHECK(in[0] == 'a' + i && in[sizeof(in) - 1] == 'a' + i);
+    }
+    // Past the end, and at the current position
+    CHECK(asyncRead(fd, in, sizeof(in), 4 * sizeof(in)) == 0);
+    CHECK(asyncWrite(fd, "xyz", 3) == 3);
+    CHECK(asyncRead(fd, in, sizeof(in), 0) == sizeof(in));
+  });
+  run();
+  ::fclose(f);
+}
+
+// Pipes are polled, the reader waits for the writer
+static void testPipe() {
+  int fds[2];
+  CHECK(::pipe(fds) == 0);
+  const int n = 100;
+  int nread = 0;
+  start([&]() {
+    int v;
+    while (nread < n && asyncRead(fds[0], &v, sizeof(v)) == sizeof(v)) {
+      CHECK(v == nread);
+      ++nread;
+    }
+  });
+  start([&]() {
+    for (int i = 0; i < n; ++i) {
+      CHECK(asyncWrite(fds[1], &i, sizeof(i)) == sizeof(i));
+      yield();
+    }
+  });
+  run();
+  CHECK(nread == n);
+  forgetFd(fds[0]);
+  forgetFd(fds[1]);
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+// The length of a request doesn't wrap around at 4 GB
+static void testHugeLength() {
+  FILE* f = ::tmpfile();
+  CHECK(f);
+  int fd = ::fileno(f);
+  size_t huge = (1ull << 32) + 8;
+  void* buf = ::mmap(nullptr, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  CHECK(buf != MAP_FAILED);
+  start([fd, buf, huge]() {
+    char out[4096];
+    memset(out, 'z', sizeof(out));
+    CHECK(asyncWrite(fd, out, sizeof(out), 0) == sizeof(out));
+    CHECK(asyncRead(fd, buf, huge, 0) == sizeof(out));
+  });
+  run();
+  ::munmap(buf, huge);
+  ::fclose(f);
+}
+
+static void testBadFd() {
+  start([]() {
+    char c;
+    CHECK(asyncRead(-1, &c, 1) < 0);
+  });
+  run();
+}
+
+int main() {
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  for (int uring = 0; uring < 2; ++uring) {
+    setIOUring(uring != 0);
+    testFile();
+    testPipe();
+    testHugeLength();
+    testBadFd();
+  }
+  return testResult();
+}
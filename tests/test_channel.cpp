@@ -0,0 +1,137 @@
+// Rendezvous channels: the items go straight from one coroutine to the other,
+// and with direct handoff the woken one runs straight away
+#include "coroutines.h"
+#include "channel.h"
+#include "test.h"
+#include <vector>
+
+using namespace Coroutines;
+
+// The parked pullers get the items in the order they parked, each push
+// returns once a puller has the item, and nothing is ever stored
+static void testRendezvousOrder() {
+  TChannel ch(0, sizeof(int));
+  const int nitems = 100;
+  std::vector<int> got[2];
+  int nerrors = 0;
+  for (int c = 0; c < 2; ++c) {
+    start([&, c]() {
+      int v;
+      while (pull(&ch, v))
+        got[c].push_back(v);
+    });
+  }
+  start([&]() {
+    for (int i = 0; i < nitems; ++i) {
+      CHECK(push(&ch, i));
+      if (ch.size() != 0)
+        ++nerrors;
+    }
+    ch.close();
+  });
+  run();
+  CHECK(nerrors == 0);
+  CHECK(got[0].size() + got[1].size() == nitems);
+  CHECK(!got[0].empty() && got[0][0] == 0);
+  CHECK(!got[1].empty() && got[1][0] == 1);
+  for (auto& g : got) {
+    for (size_t i = 1; i < g.size(); ++i) {
+      if (g[i] <= g[i - 1])
+        ++nerrors;
+    }
+  }
+  CHECK(nerrors == 0);
+}
+
+// Without a puller, push stays parked
+static void testPushWaitsForPull() {
+  TChannel ch(0, sizeof(int));
+  bool pushed = false;
+  start([&]() {
+    CHECK(push(&ch, 7));
+    pushed = true;
+  });
+  start([&]() {
+    for (int i = 0; i < 10; ++i)
+      yield();
+    CHECK(!pushed);
+    int v = 0;
+    CHECK(pull(&ch, v) && v == 7);
+  });
+  run();
+  CHECK(pushed);
+}
+
+// Closing releases the parked ones of both sides, and the parked item is
+// not delivered
+static void testCloseWithParked() {
+  TChannel to_pull(0, sizeof(int)), to_push(0, sizeof(int));
+  int nreleased = 0;
+  start([&]() {
+    int v;
+    CHECK(!pull(&to_pull, v));
+    ++nreleased;
+  });
+  start([&]() {
+    CHECK(!push(&to_push, 1));
+    ++nreleased;
+  });
+  start([&]() {
+    yield();
+    to_pull.close();
+    to_push.close();
+    int v;
+    CHECK(!pull(&to_push, v));
+  });
+  run();
+  CHECK(nreleased == 2);
+}
+
+// With direct handoff, a ping-pong keeps its order, chains up to the limit
+// of handoffs before the other ready coroutine runs, and the close with the
+// echoer parked still releases it
+static void testHandOff() {
+  setHandOffLimit(4);
+  TChannel ping(0, sizeof(int)), pong(0, sizeof(int));
+  const int nrounds = 1000;
+  bool done = false, echoer_released = false;
+  int nerrors = 0, nbystander = 0;
+  start([&]() {
+    for (int i = 0; i < nrounds; ++i) {
+      CHECK(push(&ping, i));
+      int v = -1;
+      CHECK(pull(&pong, v));
+      if (v != i)
+        ++nerrors;
+    }
+    done = true;
+    ping.close();
+  });
+  start([&]() {
+    int v;
+    while (pull(&ping, v))
+      push(&pong, v);
+    echoer_released = true;
+  });
+  start([&]() {
+    while (!done) {
+      ++nbystander;
+      yield();
+    }
+  });
+  run();
+  setHandOffLimit(0);
+  CHECK(nerrors == 0);
+  CHECK(echoer_released);
+  // Two handoffs per round, and one turn for the bystander after every 4
+  CHECK(nbystander > nrounds / 4 && nbystander < nrounds);
+}
+
+int main() {
+  initialize();
+  testRendezvousOrder();
+  testPushWaitsForPull();
+  testCloseWithParked();
+  testHandOff();
+  return testResult();
+}
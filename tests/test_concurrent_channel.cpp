@@ -0,0 +1,93 @@
+// Concurrent channels shared between coroutines and other threads
+#include "coroutines.h"
+#include "concurrent_channel.h"
+#include "test.h"
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+
+using namespace Coroutines;
+
+static const int nitems = 10000;
+static const long expected_sum = (long)nitems * (nitems - 1) / 2;
+
+static void produce(TConcurrentChannel* ch) {
+  // After the consumers are parked
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  for (int i = 0; i < nitems; ++i)
+    push(ch, i);
+  ch->close();
+}
+
+static void consume(TConcurrentChannel* ch, long* sum) {
+  int v;
+  while (pull(ch, v))
+    *sum += v;
+}
+
+// Another thread feeds coroutines run by run() or runWorkers
+static void testFromThread(int nthreads) {
+  TConcurrentChannel ch(4, sizeof(int));
+  long sum1 = 0, sum2 = 0;
+  start([&]() { consume(&ch, &sum1); });
+  start([&]() { consume(&ch, &sum2); });
+  std::thread producer(produce, &ch);
+  if (nthreads)
+    runWorkers(nthreads);
+  else
+    run();
+  producer.join();
+  CHECK(sum1 + sum2 == expected_sum);
+}
+
+// Coroutines feed another thread, blocking while the channel is full
+static void testToThread() {
+  TConcurrentChannel ch(4, sizeof(int));
+  start([&]() {
+    for (int i = 0; i < nitems; ++i)
+      push(&ch, i);
+    ch.close();
+  });
+  long sum = 0;
+  std::thread consumer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    consume(&ch, &sum);
+  });
+  run();
+  consumer.join();
+  CHECK(sum == expected_sum);
+}
+
+// run() is blocked in the poller for an fd, the wake must get it out
+static void testWhilePolling() {
+  int fds[2];
+  CHECK(::pipe(fds) == 0);
+  TConcurrentChannel ch(4, sizeof(int));
+  long sum = 0;
+  bool readable = false;
+  start([&]() { readable = waitReadable(fds[0]); });
+  start([&]() {
+    consume(&ch, &sum);
+    char c = 1;
+    CHECK(::write(fds[1], &c, 1) == 1);
+  });
+  std::thread producer(produce, &ch);
+  run();
+  producer.join();
+  CHECK(sum == expected_sum);
+  CHECK(readable);
+  forgetFd(fds[0]);
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+int main(int argc, char** argv) {
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  testFromThread(0);
+  testToThread();
+  testWhilePolling();
+  testFromThread(argc > 1 ? atoi(argv[1]) : 4);
+  return testResult();
+}
@@ -0,0 +1,107 @@
+// TEvent, as a manual reset event and as a condition variable
+#include "coroutines.h"
+#include "event.h"
+#include "channel.h"
+#include "test.h"
+#include <vector>
+
+using namespace Coroutines;
+
+// set releases all the waiters, and the later waits return at once until
+// reset. After that, waits time out again
+static void testSetReset() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  TEvent ev;
+  int nreleased = 0;
+  for (int i = 0; i < 3; ++i) {
+    start([&]() {
+      CHECK(ev.wait());
+      ++nreleased;
+    });
+  }
+  start([&]() {
+    wait(nullptr, 0, 10);
+    CHECK(nreleased == 0);
+    ev.set();
+    yield();
+    CHECK(nreleased == 3);
+    CHECK(ev.wait(5));
+    CHECK(now() == 10);
+    ev.reset();
+    CHECK(!ev.isSet());
+    CHECK(!ev.wait(5));
+    CHECK(now() == 15);
+  });
+  run();
+  CHECK(nreleased == 3);
+}
+
+// notifyOne wakes up the waiters in the order they came, without setting
+// the event. notifyAll the ones left, and nobody after them
+static void testNotify() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  TEvent ev;
+  std::vector<int> order;
+  for (int i = 0; i < 4; ++i) {
+    start([&, i]() {
+      CHECK(ev.wait());
+      order.push_back(i);
+    });
+  }
+  start([&]() {
+    yield();
+    ev.notifyOne();
+    ev.notifyOne();
+    CHECK(!ev.isSet());
+    wait(nullptr, 0, 1);
+    CHECK(order.size() == 2);
+    ev.notifyAll();
+    wait(nullptr, 0, 1);
+    CHECK(order.size() == 4);
+    // Nobody is waiting, it's lost
+    ev.notifyOne();
+    CHECK(!ev.wait(10));
+  });
+  run();
+  CHECK(order == std::vector<int>({ 0, 1, 2, 3 }));
+}
+
+// Waited for together with a channel, whichever comes first
+static void testWithChannel() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  TEvent quit;
+  TChannel ch(4, sizeof(int));
+  int nitems = 0;
+  bool quitted = false;
+  start([&]() {
+    int v;
+    while (!quitted) {
+      TWatchedEvent evts[2] = { TWatchedEvent(&quit), TWatchedEvent(&ch, v, EVT_CHANNEL_CAN_PULL) };
+      int idx = wait(evts, 2);
+      if (idx == 0)
+        quitted = true;
+      else if (ch.canPull()) {
+        ch.pull(&v, sizeof(v));
+        ++nitems;
+      }
+    }
+  });
+  start([&]() {
+    for (int i = 0; i < 3; ++i) {
+      push(&ch, i);
+      wait(nullptr, 0, 1);
+    }
+    quit.set();
+  });
+  run();
+  CHECK(nitems == 3);
+  CHECK(quitted);
+}
+
+int main() {
+  initialize();
+  testSetReset();
+  testNotify();
+  testWithChannel();
+  return testResult();
+}
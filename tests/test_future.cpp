@@ -0,0 +1,54 @@
+// async and TFuture, when the coroutine starts and when it can't
+#include "coroutines.h"
+#include "future.h"
+#include "test.h"
+#include <string>
+#include <sys/resource.h>
+
+using namespace Coroutines;
+
+// The result follows the future when it's moved before the coroutine ends
+static void testMoved() {
+  start([]() {
+    auto f = async([]() { yield(); return std::string(100, 'x'); });
+    auto moved = std::move(f);
+    CHECK(moved.get() == std::string(100, 'x'));
+    // It may be over before async returns, it must still run once
+    int nruns = 0;
+    auto v = async([&nruns]() { yield(); ++nruns; });
+    v.get();
+    CHECK(v.ready());
+    CHECK(nruns == 1);
+  });
+  run();
+}
+
+// Without memory for the stack, fn runs inside async and get() has the value
+static void testStartFails() {
+  struct rlimit old_limit;
+  CHECK(::getrlimit(RLIMIT_AS, &old_limit) == 0);
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = 1ull << 30;
+  CHECK(::setrlimit(RLIMIT_AS, &limit) == 0);
+  TStartOptions huge_stack(1u << 31);
+  start([&]() {
+    auto f = async([]() { return 42; }, huge_stack);
+    CHECK(!isHandle(f.coroutine()));
+    CHECK(f.ready());
+    CHECK(f.get() == 42);
+    bool ran = false;
+    auto v = async([&ran]() { ran = true; }, huge_stack);
+    CHECK(ran);
+    CHECK(v.ready());
+    v.get();
+  });
+  run();
+  CHECK(::setrlimit(RLIMIT_AS, &old_limit) == 0);
+}
+
+int main() {
+  initialize();
+  testMoved();
+  testStartFails();
+  return testResult();
+}
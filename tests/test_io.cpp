@@ -0,0 +1,66 @@
+// Waiting for fds: hangups of fds nobody waits for, and fds epoll rejects
+#include "coroutines.h"
+#include "test.h"
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Coroutines;
+
+// The peer hangs up when nobody is waiting for the fd anymore. The poller
+// must not keep reporting it while run() waits for other fds
+static void testHangUp() {
+  int sv[2];
+  CHECK(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  int fds[2];
+  CHECK(::pipe(fds) == 0);
+
+  start([&]() {
+    CHECK(!waitReadable(sv[0], milliseconds(1)));
+    ::close(sv[1]);
+  });
+  // Keeps run() in the poller meanwhile
+  start([&]() { CHECK(!waitReadable(fds[0], milliseconds(100))); });
+
+  std::clock_t cpu0 = std::clock();
+  run();
+  double cpu_ms = (std::clock() - cpu0) * 1000.0 / CLOCKS_PER_SEC;
+  CHECK(cpu_ms < 50);
+
+  // And it can be waited for again, it's readable now
+  start([&]() { CHECK(waitReadable(sv[0], seconds(1))); });
+  run();
+
+  forgetFd(sv[0]);
+  forgetFd(fds[0]);
+  ::close(sv[0]);
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+
+// Regular files can't be watched, the waiter gets the error
+static void testRegularFile() {
+  FILE* f = ::tmpfile();
+  CHECK(f);
+  int fd = ::fileno(f);
+  start([&]() {
+    errno = 0;
+    CHECK(!waitReadable(fd, seconds(1)));
+    CHECK(errno == EPERM);
+    CHECK(!waitWritable(fd));
+    CHECK(errno == EPERM);
+  });
+  run();
+  forgetFd(fd);
+  ::fclose(f);
+}
+
+int main() {
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  testHangUp();
+  testRegularFile();
+  return testResult();
+}
@@ -0,0 +1,71 @@
+// TSocket and TListener over 127.0.0.1
+#include "coroutines.h"
+#include "net.h"
+#include "test.h"
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace Coroutines;
+
+// A client resets its connection before it's accepted, the next one
+// must still be served
+static void testAcceptAfterReset() {
+  TListener listener;
+  CHECK(listener.listen("127.0.0.1", 0));
+  int port = listener.port();
+  int nserved = 0;
+  start([&]() {
+    while (nserved < 2) {
+      TSocket s;
+      if (!listener.accept(s, seconds(5)))
+        break;
+      char c;
+      if (s.read(&c, 1) == 1 && s.write(&c, 1) == 1)
+        ++nserved;
+    }
+  });
+  start([&]() {
+    TSocket reset;
+    CHECK(reset.connect("127.0.0.1", port));
+    struct linger lg = { 1, 0 };
+    ::setsockopt(reset.handle(), SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    reset.close();
+    for (int i = 0; i < 2; ++i) {
+      TSocket s;
+      CHECK(s.connect("127.0.0.1", port));
+      char c = 'x';
+      CHECK(s.writeAll(&c, 1));
+      CHECK(s.readExactly(&c, 1) && c == 'x');
+    }
+  });
+  run();
+  CHECK(nserved == 2);
+}
+
+// Lengths of 2 GB or more are not cut to their low bits
+static void testHugeLength() {
+  int sv[2];
+  CHECK(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+  TSocket a(sv[0]), b(sv[1]);
+  size_t huge = (4ull << 30) + 8;
+  void* buf = ::mmap(nullptr, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  CHECK(buf != MAP_FAILED);
+  start([&]() {
+    // As much as the socket buffer takes
+    int n = a.write(buf, huge);
+    CHECK(n > 8);
+    CHECK(b.read(buf, huge) == n);
+  });
+  run();
+  ::munmap(buf, huge);
+}
+
+int main() {
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  testAcceptAfterReset();
+  testHugeLength();
+  return testResult();
+}
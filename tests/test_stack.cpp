@@ -0,0 +1,56 @@
+// Stack sizes given in TStartOptions, and the usage measured
+#include "coroutines.h"
+#include "test.h"
+#include <cstring>
+
+using namespace Coroutines;
+
+static const TStackUsage* usageOf(const std::vector<TStackUsage>& usages, const char* site) {
+  for (auto& u : usages) {
+    if (strcmp(u.site, site) == 0)
+      return &u;
+  }
+  return nullptr;
+}
+
+// Stacks too small for the first frame are raised to the minimum, instead
+// of the frame going into the guard page
+static void testTinyStack() {
+  int nfinished = 0;
+  for (unsigned size : { 1u, 64u, 4096u }) {
+    start([&]() {
+      yield();
+      ++nfinished;
+    }, TStartOptions(size, "tiny"));
+  }
+  run();
+  CHECK(nfinished == 3);
+  auto usages = stackUsage();
+  auto u = usageOf(usages, "tiny");
+  CHECK(u);
+  if (!u)
+    return;
+  CHECK(u->ncoroutines == 3);
+  CHECK(u->stack_size == TCoroPlatform::min_stack_size);
+  CHECK(u->max_used > 0 && u->max_used <= u->stack_size);
+}
+
+// The default and a bigger one are kept as given
+static void testSizes() {
+  start([]() { yield(); }, TStartOptions(0, "default"));
+  start([]() { yield(); }, TStartOptions(256 * 1024, "big"));
+  run();
+  auto usages = stackUsage();
+  auto d = usageOf(usages, "default");
+  auto b = usageOf(usages, "big");
+  CHECK(d && d->stack_size == 128 * 1024);
+  CHECK(b && b->stack_size == 256 * 1024);
+}
+
+int main() {
+  initialize();
+  setStackTracking(true);
+  testTinyStack();
+  testSizes();
+  return testResult();
+}
@@ -0,0 +1,110 @@
+// The closures given to start: kept in the coroutine slot, or in the heap
+// when too big or over-aligned, alive until the coroutine ends
+#include "coroutines.h"
+#include "test.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+
+using namespace Coroutines;
+
+static std::atomic<long> nallocs(0);
+
+void* operator new(size_t n) {
+  ++nallocs;
+  if (void* p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Counts the live copies, to catch closures destroyed twice or never
+struct TTracked {
+  static int nlive;
+  int v;
+  explicit TTracked(int new_v) : v(new_v) { ++nlive; }
+  TTracked(const TTracked& other) : v(other.v) { ++nlive; }
+  TTracked(TTracked&& other) : v(other.v) { ++nlive; }
+  ~TTracked() { --nlive; }
+};
+int TTracked::nlive = 0;
+
+struct TBig {
+  char data[200];
+};
+
+struct alignas(32) TOverAligned {
+  int v;
+};
+
+// The captures are read after the coroutine has yielded, when start and
+// the scope of the caller are long gone
+static void testCaptures() {
+  int nok = 0;
+  for (int i = 0; i < 10; ++i) {
+    TTracked t(i);
+    std::string s(40, (char)('a' + i));
+    start([&nok, t, s, i]() {
+      yield();
+      if (t.v == i && s == std::string(40, (char)('a' + i)))
+        ++nok;
+    });
+    TBig big;
+    big.data[0] = big.data[199] = (char)i;
+    start([&nok, big, i]() {
+      yield();
+      if (big.data[0] == (char)i && big.data[199] == (char)i)
+        ++nok;
+    });
+    TOverAligned over;
+    over.v = i;
+    start([&nok, over, i]() {
+      yield();
+      if (((uintptr_t)&over % alignof(TOverAligned)) == 0 && over.v == i)
+        ++nok;
+    });
+    std::unique_ptr<int> owned(new int(i));
+    start([&nok, p = std::move(owned), i]() {
+      yield();
+      if (*p == i)
+        ++nok;
+    });
+  }
+  run();
+  CHECK(nok == 40);
+  CHECK(TTracked::nlive == 0);
+}
+
+// Once the slots and the stacks are there, a small closure costs no
+// allocation. The big ones take one each
+static void testAllocations() {
+  const int ncoros = 100;
+  int counter = 0;
+  auto startSmall = [&]() {
+    for (int i = 0; i < ncoros; ++i)
+      start([&counter, i]() { counter += i; yield(); });
+    run();
+  };
+  startSmall();
+  long before = nallocs;
+  startSmall();
+  CHECK(nallocs == before);
+
+  before = nallocs;
+  TBig big = {};
+  for (int i = 0; i < ncoros; ++i)
+    start([&counter, big]() { counter += big.data[0]; yield(); });
+  run();
+  CHECK(nallocs - before == ncoros);
+}
+
+int main() {
+  initialize();
+  testCaptures();
+  testAllocations();
+  return testResult();
+}
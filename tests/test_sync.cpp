@@ -0,0 +1,95 @@
+// TMutex, TSemaphore and TWaitGroup
+#include "coroutines.h"
+#include "sync.h"
+#include "test.h"
+#include <vector>
+
+using namespace Coroutines;
+
+// unlock gives the mutex to the first waiter, so the one unlocking can't
+// take it back at once, with direct handoff enabled too
+static void testMutexFairness(uint32_t handoff_limit) {
+  setHandOffLimit(handoff_limit);
+  TMutex m;
+  const int ncoros = 3, nrounds = 50;
+  std::vector<int> owners;
+  for (int i = 0; i < ncoros; ++i) {
+    start([&, i]() {
+      for (int r = 0; r < nrounds; ++r) {
+        m.lock();
+        owners.push_back(i);
+        yield();
+        m.unlock();
+      }
+    });
+  }
+  run();
+  setHandOffLimit(0);
+  CHECK(owners.size() == ncoros * nrounds);
+  // Round robin once all of them are waiting
+  int nerrors = 0;
+  for (size_t k = ncoros; k < owners.size(); ++k) {
+    if (owners[k] != owners[k - ncoros])
+      ++nerrors;
+  }
+  CHECK(nerrors == 0);
+}
+
+// At most n inside, and the releases go to the waiters in order
+static void testSemaphore() {
+  TSemaphore sem(2);
+  int inside = 0, max_inside = 0;
+  std::vector<int> order;
+  for (int i = 0; i < 5; ++i) {
+    start([&, i]() {
+      sem.acquire();
+      order.push_back(i);
+      if (++inside > max_inside)
+        max_inside = inside;
+      yield();
+      --inside;
+      sem.release();
+    });
+  }
+  run();
+  CHECK(max_inside == 2);
+  CHECK(order == std::vector<int>({ 0, 1, 2, 3, 4 }));
+  CHECK(sem.tryAcquire() && sem.tryAcquire() && !sem.tryAcquire());
+}
+
+// A wait with nothing added returns at once, also when the group has
+// already been used, and a timed one doesn't wait for its timeout
+static void testWaitGroupAtZero() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  TWaitGroup wg;
+  int ndone = 0;
+  start([&]() {
+    CHECK(wg.wait());
+    CHECK(wg.wait(100));
+    CHECK(now() == 0);
+    wg.add(2);
+    for (int i = 0; i < 2; ++i) {
+      start([&]() {
+        wait(nullptr, 0, 10);
+        ++ndone;
+        wg.done();
+      });
+    }
+    CHECK(wg.wait());
+    CHECK(ndone == 2);
+    CHECK(now() == 10);
+    CHECK(wg.wait(100));
+    CHECK(now() == 10);
+  });
+  run();
+  CHECK(ndone == 2);
+}
+
+int main() {
+  initialize();
+  testMutexFairness(0);
+  testMutexFairness(4);
+  testSemaphore();
+  testWaitGroupAtZero();
+  return testResult();
+}
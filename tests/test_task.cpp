@@ -0,0 +1,116 @@
+// Stackless tasks, mixed with fibers. Needs a C++20 compiler
+#include "coroutines.h"
+#include "channel.h"
+#include "event.h"
+#include "task.h"
+#include "test.h"
+#include <cstdlib>
+#include <string>
+
+using namespace Coroutines;
+
+static const int nitems = 2000;
+static const long items_sum = (long)nitems * (nitems - 1) / 2;
+
+static TTask<> taskConsumer(TChannel* ch, std::atomic<long>* sum) {
+  int v;
+  while (co_await awaitPull(ch, v))
+    *sum += v;
+}
+
+static TTask<> taskProducer(TChannel* ch) {
+  for (int i = 0; i < nitems; ++i)
+    CHECK(co_await awaitPush(ch, i));
+}
+
+static TTask<int> leaf(int x) {
+  co_await awaitTimeout(milliseconds(1));
+  co_return x * 2;
+}
+
+static TTask<int> middle(int x) {
+  int a = co_await leaf(x);
+  int b = co_await leaf(x + 1);
+  co_return a + b;
+}
+
+static TTask<std::string> text() {
+  co_return std::string(50, 'y');
+}
+
+static TTask<> joiner(THandle fiber, THandle task) {
+  CHECK(co_await awaitEnd(fiber));
+  CHECK(!isHandle(fiber));
+  CHECK(co_await awaitEnd(task));
+  CHECK(!co_await awaitEnd(start([]() { wait(nullptr, 0, milliseconds(50)); }), milliseconds(5)));
+  CHECK(co_await middle(10) == 42);
+  CHECK((co_await text()).size() == 50);
+  // Fibers can be started from a task
+  bool ran = false;
+  THandle h = start([&ran]() { yield(); ran = true; });
+  CHECK(co_await awaitEnd(h));
+  CHECK(ran);
+}
+
+static TTask<> idler(TEvent* ev) {
+  TWatchedEvent we(ev);
+  CHECK(co_await awaitEvents(&we, 1) == 0);
+}
+
+static void runAll(int nthreads) {
+  if (nthreads)
+    runWorkers(nthreads);
+  else
+    run();
+}
+
+// task to task, fiber to task and task to fiber
+static void testChannels(int nthreads, size_t capacity) {
+  std::atomic<long> s1(0), s2(0), s3(0);
+  TChannel c1(capacity, sizeof(int)), c2(capacity, sizeof(int)), c3(capacity, sizeof(int));
+  THandle p1 = spawn(taskProducer(&c1));
+  spawn(taskConsumer(&c1, &s1));
+  THandle p2 = start([&]() {
+    for (int i = 0; i < nitems; ++i)
+      push(&c2, i);
+  });
+  spawn(taskConsumer(&c2, &s2));
+  THandle p3 = spawn(taskProducer(&c3));
+  start([&]() {
+    int v;
+    while (pull(&c3, v))
+      s3 += v;
+  });
+  start([&]() {
+    TWatchedEvent wes[3] = { TWatchedEvent(p1), TWatchedEvent(p2), TWatchedEvent(p3) };
+    for (auto& we : wes)
+      wait(&we, 1);
+    c1.close();
+    c2.close();
+    c3.close();
+  });
+  runAll(nthreads);
+  CHECK(s1 == items_sum);
+  CHECK(s2 == items_sum);
+  CHECK(s3 == items_sum);
+}
+
+int main(int argc, char** argv) {
+  int nthreads = argc > 1 ? atoi(argv[1]) : 0;
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  testChannels(nthreads, 4);
+  testChannels(nthreads, 0);
+
+  THandle fiber = start([]() { wait(nullptr, 0, milliseconds(10)); });
+  THandle task = spawn(leaf(1));
+  spawn(joiner(fiber, task));
+  runAll(nthreads);
+
+  TEvent ev;
+  for (int i = 0; i < 10000; ++i)
+    spawn(idler(&ev));
+  start([&ev]() { yield(); ev.set(); });
+  runAll(nthreads);
+  return testResult();
+}
@@ -0,0 +1,75 @@
+// The timing wheel: deadlines on slot boundaries, and cascading from the
+// upper levels
+#include "coroutines.h"
+#include "test.h"
+#include <vector>
+
+using namespace Coroutines;
+
+// Slots of 64 ticks in level 1, 4096 in level 2 and 262144 in level 3
+static const TTimeDelta boundary_deltas[] = {
+  1, 63, 64, 65, 4095, 4096, 4097, 64 * 4096 - 1, 64 * 4096, 64 * 4096 + 1
+};
+
+// One tick at a time, each timeout fires in the tick it's due, not before,
+// after cascading down from the level it was inserted in
+static void testEachTick() {
+  setClockMode(CLOCK_MODE_TICKS);
+  std::vector<TWatchedEvent> wes;
+  for (auto d : boundary_deltas)
+    wes.emplace_back(d);
+  for (auto& we : wes)
+    registerTimeoutEvent(&we);
+  int nerrors = 0;
+  while (now() < 64 * 4096 + 2) {
+    TTimeStamp when;
+    bool pending = nextTimeout(when);
+    updateCurrentTime(1);
+    for (auto& we : wes) {
+      bool due = we.time.time_to_trigger <= now();
+      bool fired = we.time.slot == nullptr;
+      if (due != fired)
+        ++nerrors;
+      if (pending && when == now() && we.time.time_to_trigger == when && !fired)
+        ++nerrors;
+    }
+  }
+  CHECK(nerrors == 0);
+  TTimeStamp when;
+  CHECK(!nextTimeout(when));
+}
+
+// Timeouts programmed from a time which is not on a boundary, and far away
+// ones, reached by the jumps of the virtual clock
+static void testJumps() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  std::vector<TTimeStamp> woken_at;
+  const TTimeDelta far_deltas[] = { 4096, 1ull << 30, (1ull << 36) + 1, 64 };
+  for (auto d : far_deltas) {
+    start([&woken_at, d]() {
+      wait(nullptr, 0, d);
+      woken_at.push_back(now());
+    });
+  }
+  start([&woken_at]() {
+    wait(nullptr, 0, 100);
+    // Due right on the next level 2 boundary
+    wait(nullptr, 0, 4096 - 100);
+    woken_at.push_back(now());
+  });
+  run();
+  CHECK(woken_at.size() == 5);
+  if (woken_at.size() != 5)
+    return;
+  CHECK(woken_at[0] == 64);
+  CHECK(woken_at[1] == 4096 && woken_at[2] == 4096);
+  CHECK(woken_at[3] == 1ull << 30);
+  CHECK(woken_at[4] == (1ull << 36) + 1);
+}
+
+int main() {
+  initialize();
+  testEachTick();
+  testJumps();
+  return testResult();
+}
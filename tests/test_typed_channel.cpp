@@ -0,0 +1,96 @@
+// TTypedChannel: the index wrapping around the slots, and items which are
+// not trivially copyable
+#include "coroutines.h"
+#include "typed_channel.h"
+#include "test.h"
+#include <string>
+
+using namespace Coroutines;
+
+// Moved, never copied. Counts the live ones to catch leaks and double frees
+struct TItem {
+  static int nlive;
+  std::string text;
+  TItem() { ++nlive; }
+  explicit TItem(int n) : text(std::to_string(n) + std::string(32, '.')) { ++nlive; }
+  TItem(TItem&& other) : text(std::move(other.text)) { ++nlive; }
+  TItem& operator=(TItem&& other) { text = std::move(other.text); return *this; }
+  TItem(const TItem&) = delete;
+  TItem& operator=(const TItem&) = delete;
+  ~TItem() { --nlive; }
+};
+int TItem::nlive = 0;
+
+static bool isItem(const TItem& item, int n) {
+  return item.text == std::to_string(n) + std::string(32, '.');
+}
+
+// Pushing and pulling different amounts each round moves the first slot
+// all around the ring. The order must hold
+static void testWraparound() {
+  TTypedChannel<int, 4> ch;
+  int next_in = 0, next_out = 0, nerrors = 0;
+  for (int round = 0; round < 100; ++round) {
+    int npush = 1 + round % 4;
+    for (int i = 0; i < npush && ch.canPush(); ++i)
+      ch.push(next_in++);
+    int npull = 1 + (round * 3) % 4;
+    for (int i = 0; i < npull && ch.canPull(); ++i) {
+      int v;
+      ch.pull(v);
+      if (v != next_out++)
+        ++nerrors;
+    }
+  }
+  CHECK(nerrors == 0);
+  CHECK(next_in - next_out == (int)ch.size());
+}
+
+// Producers and consumers parked on both sides, so the items also go
+// through the handoffs to/from the waiters
+static void testNotTriviallyCopyable() {
+  const int nitems = 1000;
+  {
+    TTypedChannel<TItem, 2> ch;
+    int nreceived = 0, nerrors = 0;
+    start([&]() {
+      TItem item;
+      while (pull(&ch, item)) {
+        if (!isItem(item, nreceived++))
+          ++nerrors;
+        if (nreceived % 3 == 0)
+          yield();
+      }
+    });
+    start([&]() {
+      for (int i = 0; i < nitems; ++i) {
+        CHECK(push(&ch, TItem(i)));
+        if (i % 7 == 0)
+          yield();
+      }
+      ch.close();
+    });
+    run();
+    CHECK(nreceived == nitems);
+    CHECK(nerrors == 0);
+    CHECK(TItem::nlive == 0);
+
+    // The ones left in the channel are destroyed with it
+    TTypedChannel<TItem, 2> left;
+    left.push(TItem(1));
+    left.push(TItem(2));
+    TItem first;
+    left.pull(first);
+    left.push(TItem(3));
+    CHECK(isItem(first, 1));
+    CHECK(TItem::nlive == 3);
+  }
+  CHECK(TItem::nlive == 0);
+}
+
+int main() {
+  initialize();
+  testWraparound();
+  testNotTriviallyCopyable();
+  return testResult();
+}
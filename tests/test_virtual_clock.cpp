@@ -0,0 +1,46 @@
+// The virtual clock jumps to the next timeout with run() and with runWorkers
+#include "coroutines.h"
+#include "test.h"
+#include <chrono>
+
+using namespace Coroutines;
+
+// Returns the wall time taken, in ms
+static double runTimeouts(int nthreads) {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  const int n = 20;
+  int nwoken = 0;
+  bool in_order = true;
+  TTimeStamp last = 0;
+  for (int i = 1; i <= n; ++i) {
+    start([&, i]() {
+      // The counters are shared by the workers
+      internal::TScopedLock lock;
+      wait(nullptr, 0, i * 2000);
+      // The first worker ticks once per coroutine run, so a bit later
+      in_order = in_order && now() >= (TTimeStamp)i * 2000 && now() >= last;
+      last = now();
+      ++nwoken;
+    });
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  if (nthreads)
+    runWorkers(nthreads);
+  else
+    run();
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  CHECK(nwoken == n);
+  CHECK(in_order);
+  CHECK(now() >= (TTimeStamp)n * 2000);
+  return ms;
+}
+
+int main() {
+  initialize();
+  for (int nthreads = 0; nthreads <= 2; ++nthreads) {
+    double ms = runTimeouts(nthreads);
+    // 40000 ticks, at the 1 ms the idle workers sleep, would take 40 s
+    CHECK(ms < 500);
+  }
+  return testResult();
+}
@@ -0,0 +1,111 @@
+// wait() on several events, and its two halves beginWait/endWait
+#include "coroutines.h"
+#include "channel.h"
+#include "event.h"
+#include "test.h"
+#include <cstdlib>
+
+using namespace Coroutines;
+
+// Already set events return without suspending, the first one in the list
+static void testReady() {
+  TChannel ch1(4, sizeof(int));
+  TChannel ch2(4, sizeof(int));
+  TEvent ev;
+  ev.set();
+  int v = 1;
+  push(&ch2, v);
+  TWatchedEvent wes[3] = {
+    TWatchedEvent(&ch1, v, EVT_CHANNEL_CAN_PULL)
+  , TWatchedEvent(&ch2, v, EVT_CHANNEL_CAN_PULL)
+  , TWatchedEvent(&ev)
+  };
+  CHECK(wait(wes, 3) == 1);
+  CHECK(wait(wes, 3, 0) == 1);
+  CHECK(wait(wes + 2, 1) == 0);
+  // Nothing left attached
+  CHECK(ch1.waiting_for_pull.empty());
+  CHECK(ch2.waiting_for_pull.empty());
+  CHECK(ev.waiters.empty());
+}
+
+// The index of the one which woke us up, or wait_timedout
+static void testWakeUp() {
+  TChannel ch1(4, sizeof(int));
+  TChannel ch2(4, sizeof(int));
+  int v = 0;
+  THandle h = start([&]() {
+    wait(nullptr, 0, milliseconds(5));
+    int x = 7;
+    push(&ch2, x);
+  });
+  TWatchedEvent wes[2] = {
+    TWatchedEvent(&ch1, v, EVT_CHANNEL_CAN_PULL)
+  , TWatchedEvent(&ch2, v, EVT_CHANNEL_CAN_PULL)
+  };
+  CHECK(wait(wes, 2, seconds(5)) == 1);
+  CHECK(ch1.waiting_for_pull.empty());
+  CHECK(ch2.waiting_for_pull.empty());
+  CHECK(wait(wes, 1, milliseconds(5)) == wait_timedout);
+  CHECK(ch1.waiting_for_pull.empty());
+  TWatchedEvent we_end(h);
+  CHECK(wait(&we_end, 1, seconds(5)) == 0);
+  CHECK(!isHandle(h));
+}
+
+// What wait() does, split as the stackless coroutines use it
+static void testHalves() {
+  TEvent ev;
+  start([&]() { yield(); ev.notifyOne(); });
+  internal::TScopedLock lock;
+  TWatchedEvent we(&ev);
+  TWatchedEvent time_we;
+  int idx = internal::beginWait(&we, 1, seconds(5), &time_we);
+  CHECK(idx == internal::wait_must_suspend);
+  CHECK(!ev.waiters.empty());
+  yield();
+  CHECK(internal::endWait(&we, 1, seconds(5), &time_we) == 0);
+  CHECK(ev.waiters.empty());
+
+  ev.set();
+  CHECK(internal::beginWait(&we, 1, seconds(5), &time_we) == 0);
+  CHECK(ev.waiters.empty());
+}
+
+// Many coroutines waiting in several threads for a channel or a timeout
+static std::atomic<int> nreceived(0);
+static std::atomic<int> ntimeouts(0);
+
+static void testWorkers(int nthreads) {
+  const int n = 200;
+  TChannel ch(n, sizeof(int));
+  for (int i = 0; i < n; ++i) {
+    start([&ch, i]() {
+      int v;
+      TWatchedEvent we(&ch, v, EVT_CHANNEL_CAN_PULL);
+      int idx = wait(&we, 1, i % 2 ? milliseconds(1) : seconds(10));
+      if (idx == wait_timedout)
+        ++ntimeouts;
+      else if (pull(&ch, v))
+        ++nreceived;
+    });
+  }
+  start([&ch]() {
+    for (int i = 0; i < n; ++i)
+      push(&ch, i);
+  });
+  runWorkers(nthreads);
+  CHECK(nreceived + ntimeouts == n);
+  CHECK(nreceived >= n / 2);
+}
+
+int main(int argc, char** argv) {
+  initialize();
+  setClockMode(CLOCK_MODE_MONOTONIC);
+  start(&testReady);
+  start(&testWakeUp);
+  start(&testHalves);
+  run();
+  testWorkers(argc > 1 ? atoi(argv[1]) : 4);
+  return testResult();
+}
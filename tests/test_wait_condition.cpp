@@ -0,0 +1,59 @@
+// wait(fn) evaluated by the scheduler, mixed with timeouts
+#include "coroutines.h"
+#include "test.h"
+
+using namespace Coroutines;
+
+// A condition polled each pass must not stop the virtual clock, the
+// timeout which releases it has to fire
+static void testVirtualClock() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  bool flag = false;
+  TTimeStamp released_at = 0;
+  start([&]() {
+    wait([&]() { return !flag; });
+    released_at = now();
+  });
+  start([&]() {
+    wait(nullptr, 0, 100);
+    flag = true;
+  });
+  run();
+  CHECK(flag);
+  CHECK(released_at == 100);
+}
+
+// With a poll interval, the clock jumps to the next evaluation when it
+// comes before the next timeout
+static void testPollInterval() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  int nevals = 0;
+  TTimeStamp released_at = 0;
+  start([&]() {
+    wait([&]() { return ++nevals < 5; }, 30);
+    released_at = now();
+  });
+  start([&]() { wait(nullptr, 0, 1000); });
+  run();
+  CHECK(nevals == 5);
+  CHECK(released_at == 120);
+  CHECK(now() == 1000);
+}
+
+// Nothing can release it, so run() returns instead of spinning
+static void testNobodyReleases() {
+  setClockMode(CLOCK_MODE_VIRTUAL);
+  bool flag = false;
+  start([&]() { wait([&]() { return !flag; }); });
+  run();
+  flag = true;
+  run();
+}
+
+int main() {
+  initialize();
+  testVirtualClock();
+  testPollInterval();
+  testNobodyReleases();
+  return testResult();
+}